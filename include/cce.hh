@@ -13,8 +13,10 @@
 #include <iostream>
 #include <sstream>
 #include <cmath>
+#include <chrono>
 
 // Multithreading support
+#include <atomic>
 #include <mutex>
 #include <thread>
 
@@ -100,12 +102,159 @@ typedef uint64_t bb;
 // Creates a bitmask from a single bit, _i, as a 1 bit, the rest being zeros
 #define ONEHOT(_i) (1ULL << (_i))
 
+// Bitboards of the edge files, and some ranks
+#define FILE_A 0x0101010101010101ULL
+#define FILE_H 0x8080808080808080ULL
+#define RANK_1 0x00000000000000FFULL
+#define RANK_3 0x0000000000FF0000ULL
+#define RANK_6 0x0000FF0000000000ULL
+#define RANK_8 0xFF00000000000000ULL
+
+// Shifts every tile in a bitboard by 'n' (which may be negative), as in 'tile + n'
+// NOTE: Tiles wrap around to the other side of the board, so mask off the edge files first
+inline bb shift(bb v, int n) {
+    return n >= 0 ? v << n : v >> -n;
+}
+
+
+/* Attack Tables */
+
+// cce::magic - Magic bitboard entry for a single tile
+//
+// The attacks of a sliding piece only depend on the occupancy of the tiles it could
+//   move through, so those bits are hashed (by multiplication) into a precomputed table
+//
+// SEE: https://www.chessprogramming.org/Magic_Bitboards
+//
+struct magic {
+
+    // Relevant occupancy mask (the rays, excluding the edges of the board)
+    bb mask;
+
+    // Magic multiplier
+    bb mul;
+
+    // Table of attacks, indexed by the hashed occupancy
+    bb* attacks;
+
+    // Amount to shift the product down by
+    int shift;
+
+};
+
+// Magic entries for bishops and rooks, for each tile
+// NOTE: 'init()' must be called before these are used
+extern magic magic_B[64], magic_R[64];
+
+// Tiles attacked by a king or knight on a given tile
+extern bb attacks_K[64], attacks_N[64];
+
+// Tiles attacked by a pawn of a given color on a given tile
+extern bb attacks_P[N_COLORS][64];
+
+// Tiles strictly between two tiles, if they are on the same rank, file, or diagonal (otherwise 0)
+extern bb tiles_between[64][64];
+
+// Tiles on the entire line (rank, file, or diagonal) through two tiles, including
+//   them (or 0 if they aren't aligned)
+extern bb tiles_line[64][64];
+
+// Initialize the attack tables (called by 'init()')
+void init_attacks();
+
+// Returns the tiles a bishop on 'tile' attacks, given the occupied tiles 'occ'
+inline bb bishop_attacks(int tile, bb occ) {
+    const magic& m = magic_B[tile];
+    return m.attacks[((occ & m.mask) * m.mul) >> m.shift];
+}
+
+// Returns the tiles a rook on 'tile' attacks, given the occupied tiles 'occ'
+inline bb rook_attacks(int tile, bb occ) {
+    const magic& m = magic_R[tile];
+    return m.attacks[((occ & m.mask) * m.mul) >> m.shift];
+}
+
+// Returns the tiles a queen on 'tile' attacks, given the occupied tiles 'occ'
+inline bb queen_attacks(int tile, bb occ) {
+    return bishop_attacks(tile, occ) | rook_attacks(tile, occ);
+}
+
+
+/* Zobrist Hashing */
+
+// Random keys which are XOR'd together to make a hash of a position
+// There is a key for each piece on each tile, for the color to move being black,
+//   for each combination of castling rights, and for the file of the en-passant tile
+// SEE: https://www.chessprogramming.org/Zobrist_Hashing
+extern uint64_t zobrist_piece[N_COLORS][N_PIECES][64];
+extern uint64_t zobrist_tomove;
+extern uint64_t zobrist_castle[16];
+extern uint64_t zobrist_ep[8];
+
+// Initialize the Zobrist keys (called by 'init()')
+void init_zobrist();
+
 
 /* Utilities */
 
-// Compute a list of the tiles in a bitboard, returning the number, and storing in 'pos'
-// NOTE: 'pos' should be able to hold '64' integers
-int bbtiles(bb v, int pos[64]);
+// Initialize the global tables (which are built once at startup)
+// This is safe to call multiple times
+void init();
+
+// Returns the number of tiles set in a bitboard
+inline int popcount(bb v) {
+    return __builtin_popcountll(v);
+}
+
+// Returns the lowest tile set in a bitboard
+// NOTE: 'v' must not be 0
+inline int lsb(bb v) {
+    assert(v != 0);
+    return __builtin_ctzll(v);
+}
+
+// Removes the lowest tile set in a bitboard, and returns it
+// NOTE: 'v' must not be 0
+inline int poplsb(bb& v) {
+    int r = lsb(v);
+    v &= v - 1;
+    return r;
+}
+
+// cce::bbiter - Iterator over the tiles set in a bitboard, from lowest to highest
+//
+// This only does work for the bits that are set, so it is proportional to the number of pieces
+//
+struct bbiter {
+
+    // Tiles that have not been visited yet
+    bb v;
+
+    int operator*() const { return lsb(v); }
+    bbiter& operator++() { v &= v - 1; return *this; }
+    bool operator!=(const bbiter& other) const { return v != other.v; }
+
+};
+
+// cce::bbrange - Range of tiles in a bitboard, for use with range-based for loops
+//
+// Use 'bbtiles(v)' to create one, like:
+//   for (int tile : bbtiles(v)) { ... }
+//
+struct bbrange {
+
+    // Bitboard being iterated over
+    bb v;
+
+    bbiter begin() const { return { v }; }
+    bbiter end() const { return { 0 }; }
+
+};
+
+// Returns a range over the tiles set in 'v'
+inline bbrange bbtiles(bb v) {
+    return { v };
+}
 
 // Returns a string representing the algebraic name for a tile
 const string& tile_name(int tile);
@@ -114,26 +263,179 @@ const string& tile_name(int tile);
 // White are uppercase, black are lowercase
 const string& cp_name(Color c, Piece p);
 
+// Parse 'str' as a whole decimal integer into 'res', returning whether it was one (that fits)
+// Nothing is thrown, so this is safe to use on input from the GUI
+bool parse_int(const string& str, int64_t& res);
+bool parse_int(const string& str, int& res);
+
+// Material value of each piece (indexed by 'Piece::*'), in centipawns
+// The king is given no value, since it can never be captured
+extern const int piece_value[N_PIECES];
+
+
+// Move flags, which tell what kind of move it is
+// These are stored in 4 bits, where bit 3 means a promotion, and bit 2 means a capture. For
+//   promotions, the lower 2 bits give the piece being promoted to
+// SEE: https://www.chessprogramming.org/Encoding_Moves
+enum MoveFlag {
+
+    // Quiet move (no capture)
+    MF_QUIET   = 0,
+    // Pawn moving forward 2 tiles
+    MF_DOUBLE  = 1,
+    // Castling kingside
+    MF_KCASTLE = 2,
+    // Castling queenside
+    MF_QCASTLE = 3,
+    // Capturing a piece on 'to'
+    MF_CAPTURE = 4,
+    // Capturing a pawn en-passant
+    MF_EP      = 5,
+
+    // Promotions (to knight, bishop, rook, queen)
+    MF_PN      = 8,
+    MF_PB      = 9,
+    MF_PR      = 10,
+    MF_PQ      = 11,
+
+    // Promotions, while capturing a piece on 'to'
+    MF_PNC     = 12,
+    MF_PBC     = 13,
+    MF_PRC     = 14,
+    MF_PQC     = 15,
+
+};
 
-// cce::move - Simple move structure, just containing the from and to 
+// cce::move - Move structure, packed into 16 bits
 //
+// Bits 0-5 are the tile being moved from, bits 6-11 are the tile being moved to, and
+//   bits 12-15 are the flags ('MF_*' values)
+//
+// Since a piece can't move to its own tile, all zeros is used as the 'bad' move
 //
 struct move {
 
+    // Packed from, to, and flags
+    uint16_t bits;
+
+    move() : bits(0) {}
+    move(int from_, int to_, int flags_=MF_QUIET) : bits(from_ | (to_ << 6) | (flags_ << 12)) {}
+
     // Tile being moved from
-    int from;
+    int from() const { return bits & 0x3F; }
 
     // Tile being moved to
-    int to;
+    int to() const { return (bits >> 6) & 0x3F; }
+
+    // Flags of the move (one of 'MF_*')
+    int flags() const { return bits >> 12; }
 
-    move(int from_=-1, int to_=-1) : from(from_), to(to_) {}
+    // Returns whether the move is unintialized
+    bool isbad() const { return bits == 0; }
 
-    // Returns whether the move is unintialized or out of range
+    // Returns whether the move captures a piece (including en-passant)
+    bool iscapture() const { return (bits >> 12) & MF_CAPTURE; }
 
-    bool isbad() const { return from < 0 || to < 0; }
+    // Returns whether the move is a promotion
+    bool ispromo() const { return (bits >> 12) & MF_PN; }
+
+    // Returns the piece being promoted to (only valid if 'ispromo()')
+    Piece promo() const {
+        static const Piece pieces[] = { Piece::N, Piece::B, Piece::R, Piece::Q };
+        return pieces[(bits >> 12) & 3];
+    }
+
+    bool operator==(const move& other) const { return bits == other.bits; }
+    bool operator!=(const move& other) const { return bits != other.bits; }
 
     // Return long algebraic notation
-    string LAN() const { return isbad() ? "0000" : tile_name(from) + tile_name(to); }
+    string LAN() const {
+        if (isbad()) return "0000";
+        string r = tile_name(from()) + tile_name(to());
+        if (ispromo()) {
+            // Always lowercase, regardless of color
+            r += cp_name(Color::BLACK, promo());
+        }
+        return r;
+    }
+};
+
+// Maximum number of moves that can be stored in a 'movelist'
+// NOTE: The most legal moves in any reachable position is 218
+#define MAX_MOVES 256
+
+// cce::movelist - Fixed-capacity list of moves
+//
+// This lives on the stack (unlike 'vector<move>'), so generating moves doesn't touch
+//   the heap. It has the parts of the 'vector' interface that we use
+//
+struct movelist {
+
+    // Number of moves stored
+    int n;
+
+    // Storage for the moves, of which the first 'n' are valid
+    move data[MAX_MOVES];
+
+    movelist() : n(0) {}
+
+    // Remove all moves
+    void clear() { n = 0; }
+
+    // Add a move to the end
+    void push_back(const move& mv) {
+        assert(n < MAX_MOVES);
+        data[n++] = mv;
+    }
+
+    // Return the number of moves
+    int size() const { return n; }
+
+    move& operator[](int i) { return data[i]; }
+    const move& operator[](int i) const { return data[i]; }
+
+    move* begin() { return data; }
+    move* end() { return data + n; }
+    const move* begin() const { return data; }
+    const move* end() const { return data + n; }
+
+};
+
+// Which moves to generate (see 'State::getmoves()')
+enum Gen {
+
+    // All legal moves
+    GEN_ALL   = 0,
+    // Captures and promotions, which change the material on the board
+    GEN_NOISY = 1,
+    // All other moves
+    GEN_QUIET = 2,
+
+};
+
+// cce::undo - Information needed to undo a move
+//
+// This is everything about a state that can't be recovered from the move itself
+//
+struct undo {
+
+    // Piece that was captured on the 'to' tile, or -1 if none
+    // NOTE: En-passant captures always capture a pawn, so this is -1 for them
+    int captured;
+
+    // Castling rights before the move
+    bool c_WK, c_WQ;
+    bool c_BK, c_BQ;
+
+    // En-passant target square before the move
+    int ep;
+
+    // Half move clock before the move
+    int hmclock;
+
+    // Zobrist hash before the move
+    uint64_t key;
+
 };
 
 // cce::State - Chess board state
@@ -150,6 +452,10 @@ struct State {
     //   pieces are located where on the board
     bb piece[N_PIECES];
 
+    // Mailbox telling which piece is on each tile (or -1 if empty), which is kept in sync
+    //   with 'piece', and lets us look up a tile without checking every bitboard
+    int8_t board[64];
+
     // Which color is about to move?
     Color tomove;
 
@@ -170,6 +476,10 @@ struct State {
     // The number of full-moves, starting at 0, and incremented after black's move
     int fullmove;
 
+    // Zobrist hash of the position, which is updated incrementally by 'make()'
+    // NOTE: This does not include 'hmclock' or 'fullmove'
+    uint64_t key;
+
     State() {
         for (int i = 0; i < N_COLORS; ++i) {
             color[i] = 0;
@@ -177,11 +487,15 @@ struct State {
         for (int i = 0; i < N_PIECES; ++i) {
             piece[i] = 0;
         }
+        for (int i = 0; i < 64; ++i) {
+            board[i] = -1;
+        }
         tomove = Color::WHITE;
         c_WK = c_WQ = c_BK = c_BQ = true;
         ep = -1;
         hmclock = 0;
         fullmove = 0;
+        key = compute_key();
     }
 
     // Create a new state from FEN notation
@@ -192,149 +506,91 @@ struct State {
     // SEE: https://en.wikipedia.org/wiki/Forsyth%E2%80%93Edwards_Notation
     string to_FEN() const;
 
-    // Gets a list of valid moves (from the 'tomove's players perspective), populating 'res'
+    // Gets a list of legal moves (from the 'tomove's players perspective), populating 'res'
     // Clears 'res' first
-    // If 'ignorepins==true', then generate moves ignoring pinned pieces
-    // If 'ignorecastling==true', then generate moves ignoring castling
-    void getmoves(vector<move>& res, bool ignorepins=false, bool ignorecastling=false) const;
+    // If 'gen' is given, only those kinds of moves are generated
+    void getmoves(movelist& res, Gen gen=Gen::GEN_ALL) const;
+
+    // Returns whether 'mv' is a legal move in this position (i.e. whether 'getmoves()'
+    //   would generate it), which is used to check moves that didn't come from 'getmoves()'
+    bool is_legal(const move& mv) const;
 
     // Queries a tile on the board, and returns whether it is occupied
     // If it was occupied, sets 'c' and 'p' to the color and piece that occupied
     //   it, respectively
     bool query(int tile, Color& c, Piece& p) const {
-        bb m = ONEHOT(tile);
-        for (int i = 0; i < N_PIECES; ++i) {
-            if (piece[i] & m) {
-                // Found
-                c = (color[Color::WHITE] & m) ? Color::WHITE : Color::BLACK;
-                p = Piece(i);
-                return true;
-            }
+        if (board[tile] < 0) {
+            // Not found
+            return false;
         }
-        // Not found
-        return false;
+        c = (color[Color::WHITE] & ONEHOT(tile)) ? Color::WHITE : Color::BLACK;
+        p = Piece(board[tile]);
+        return true;
     }
 
-    // Apply a move to a state
-    void apply(const move& mv) {
-        // Get masks
-        bb mf = ONEHOT(mv.from), mt = ONEHOT(mv.to);
-        Color other = tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
-
-        int i, p;
-        for (p = 0; p < N_PIECES; ++p) {
-            if (piece[p] & mf) {
-                // Found piece moving from
-                break;
-            }
-        }
-        // Assert we found a piece from the place that is moving!
-        //assert(p < N_PIECES);
-        if (p >= N_PIECES) {
-            cout << "IN " << to_FEN() << " MOVE " << mv.LAN() << endl;
-        }
+    // Returns the castling rights as a 4 bit mask (WK, WQ, BK, BQ from lowest to highest)
+    int castling() const {
+        return (int)c_WK | ((int)c_WQ << 1) | ((int)c_BK << 2) | ((int)c_BQ << 3);
+    }
 
-        // Remove where it was moving from
-        color[tomove] &= ~mf;
-        color[other] &= ~mf;
+    // Compute the Zobrist hash of the position from scratch
+    // Normally, 'key' is used instead, which should always be equal to this
+    uint64_t compute_key() const;
 
-        // Now, add it where it is moving to, and clear opposite color tile if it was present
-        color[tomove] |= mt;
-        color[other] &= ~mt;
+    // Make a move on the board, in place, storing what is needed to take it back in 'u'
+    void make(const move& mv, undo& u);
 
+    // Take back a move, which must have been the last one made with 'make()' (and 'u' must
+    //   be what it stored)
+    void unmake(const move& mv, const undo& u);
 
-        // Remove piece where it was moving from
-        piece[p] &= ~mf;
+    // Pass the turn to the other color without moving (a 'null move'), which is not legal chess,
+    //   but is used by the search to find positions that are good even without a move
+    // NOTE: Must not be used while in check
+    void make_null(undo& u);
 
-        // Remove from all pieces
-        for (i = 0; i < N_PIECES; ++i) {
-            piece[i] &= ~mt;
-        }
+    // Take back a null move made with 'make_null()'
+    void unmake_null(const undo& u);
 
-        // Add it back where it is moving to
-        piece[p] |= mt;
-
-
-        // Handle castling
-        if (tomove == Color::WHITE) {
-            if (mv.from == TILE(4, 0)) {
-                if (mv.to == TILE(6, 0) && c_WK) {
-                    // White kingside
-                    bb rf = ONEHOT(TILE(7, 0));
-                    bb rt = ONEHOT(TILE(5, 0));
-                    color[Color::WHITE] &= ~rf;
-                    color[Color::WHITE] |= rt;
-                    piece[Piece::R] &= ~rf;
-                    piece[Piece::R] |= rt;
-                } else if (mv.to == TILE(2, 0) && c_WQ) {
-                    // White queenside
-                    bb rf = ONEHOT(TILE(0, 0));
-                    bb rt = ONEHOT(TILE(3, 0));
-                    color[Color::WHITE] &= ~rf;
-                    color[Color::WHITE] |= rt;
-                    piece[Piece::R] &= ~rf;
-                    piece[Piece::R] |= rt;
-                }
-                c_WK = c_WQ = false;
-            }
-            if (mv.from == TILE(0, 0)) {
-                c_WQ = false;
-            } else if (mv.from == TILE(0, 7)) {
-                c_WK = false;
-            }
-        } else {
-            if (mv.from == TILE(4, 7)) {
-                if (mv.to == TILE(6, 7) && c_BK) {
-                    // Black kingside
-                    bb rf = ONEHOT(TILE(7, 7));
-                    bb rt = ONEHOT(TILE(5, 7));
-                    color[Color::WHITE] &= ~rf;
-                    color[Color::WHITE] |= rt;
-                    piece[Piece::R] &= ~rf;
-                    piece[Piece::R] |= rt;
-                    c_WK = false;
-                } else if (mv.to == TILE(2, 7) && c_BQ) {
-                    // Black queenside
-                    bb rf = ONEHOT(TILE(0, 7));
-                    bb rt = ONEHOT(TILE(3, 7));
-                    color[Color::WHITE] &= ~rf;
-                    color[Color::WHITE] |= rt;
-                    piece[Piece::R] &= ~rf;
-                    piece[Piece::R] |= rt;
-                }
-
-                c_BK = c_BQ = false;
-            }
+    // Versions of 'make()' and 'unmake()' specialized for the color 'Us' making the move, so
+    //   things like the direction of pawns are known at compile time
+    // The versions above just dispatch to these
+    template<Color Us>
+    void make(const move& mv, undo& u);
+    template<Color Us>
+    void unmake(const move& mv, const undo& u);
 
-            if (mv.from == TILE(7, 0)) {
-                c_BQ = false;
-            } else if (mv.from == TILE(7, 7)) {
-                c_BK = false;
-            }
-        }
+    // Apply a move to a state (which can't be taken back)
+    void apply(const move& mv) {
+        undo u;
+        make(mv, u);
+    }
 
+    // Returns a bitboard of all pieces (of either color) attacking 'tile', assuming the
+    //   occupied tiles are 'occ' (which may differ from the board, for x-rays)
+    bb attackers(int tile, bb occ) const;
 
+    // Static exchange evaluation of 'mv', which returns the material (in centipawns) that the side
+    //   to move gains if both sides keep capturing on 'mv.to()' with their least valuable piece
+    //   for as long as it pays off
+    // Sliders that are uncovered by a capture (x-rays) join in, but pins are ignored
+    int see(const move& mv) const;
 
-        // TODO: Handle en passant
-        ep = -1;
+    // Returns whether the tile 'tile' is being attacked by any piece of color 'by'
+    bool is_attacked(int tile, Color by) const;
 
-        // Increment half move clock (TODO: check if it should be reset)
-        hmclock++;
+    // Version of 'is_attacked()' specialized for the attacking color
+    template<Color By>
+    bool is_attacked(int tile) const;
 
-        // Now, increment state variables
-        if (tomove == Color::WHITE) {
-            // White
-            tomove = Color::BLACK;
-        } else {
-            // Black
-            fullmove++;
-            tomove = Color::WHITE;
-        }
+    // Returns whether the tile 'tile' is being attacked by the color about to move
+    bool is_attacked(int tile) const { return is_attacked(tile, tomove); }
 
-    }
+    // Returns a bitboard of the enemy pieces giving check to the king of the color about to move
+    bb checkers() const;
 
-    // Returns whether the tile 'tile' is being attacked by the color about to move
-    bool is_attacked(int tile) const;
+    // Returns whether the color about to move is in check
+    bool in_check() const { return checkers() != 0; }
 
     // Calculates whether the state represents a finished game, either by stalemate or checkmate (or draw
     //   due to repetition)
@@ -343,6 +599,67 @@ struct State {
 
 };
 
+// cce::MovePicker - Yields the legal moves of a position one at a time, in stages
+//
+// Most nodes in a search cut off after the first move or two, so each stage is only
+//   generated once the previous one runs out:
+//   1. The hash move (i.e. the best move from an earlier search of this position)
+//   2. Captures and promotions, most valuable victim first, then least valuable attacker
+//   3. Killer moves (quiet moves that caused a cutoff in a sibling node), and the countermove
+//        (the quiet move that last refuted the opponent's previous move)
+//   4. All other quiet moves, ordered by their history score (see 'Searcher::history')
+//
+// If 'noisyonly' is given, only the first two stages are used (and the hash move is skipped
+//   unless it is noisy), which is what quiescence search needs
+//
+// NOTE: The state must be the same each time 'next()' is called
+//
+struct MovePicker {
+
+    // Stages, in the order they are used
+    enum Stage {
+        STAGE_HASH,
+        STAGE_NOISY_GEN,
+        STAGE_NOISY,
+        STAGE_KILLERS,
+        STAGE_QUIET_GEN,
+        STAGE_QUIET,
+        STAGE_DONE,
+    };
+
+    // State moves are being picked for
+    const State& s;
+
+    // Move to try first, which may be bad
+    move hashmove;
+
+    // Quiet moves to try before the rest, which may be bad
+    move killers[2];
+    move countermove;
+
+    // History scores for the side to move, indexed by [from][to] (or NULL to not sort quiet moves)
+    const int (*history)[64];
+
+    // Whether to only yield captures and promotions
+    bool noisyonly;
+
+    // Current stage
+    int stage;
+
+    // Moves generated for the current stage, and their ordering scores
+    movelist moves;
+    int scores[MAX_MOVES];
+
+    // Position within the current stage
+    int idx;
+
+    MovePicker(const State& s_, move hashmove_=move(), const move* killers_=NULL, bool noisyonly_=false, move countermove_=move(), const int (*history_)[64]=NULL);
+
+    // Returns the next move, or a bad move (see 'move::isbad()') once there are none left
+    move next();
+
+};
+
 // cce::eval - Chess position evaluation
 //
 //
@@ -431,6 +748,303 @@ struct eval {
 };
 
 
+// Search scores are integers in centipawns, from the perspective of the side to move
+// Being checkmated 'n' plies from the root scores '-SCORE_MATE + n' (and delivering it scores
+//   'SCORE_MATE - n'), so faster mates are preferred
+#define SCORE_INF 32000
+#define SCORE_MATE 31000
+
+// Maximum number of plies searched from the root
+#define MAX_PLY 128
+
+// Returns whether 'score' is a checkmate score (for either side)
+inline bool score_ismate(int score) {
+    return score >= SCORE_MATE - MAX_PLY || score <= -SCORE_MATE + MAX_PLY;
+}
+
+// Convert a search score for the side to move, 'tomove', into an 'eval'
+inline eval score_toeval(int score, Color tomove) {
+    float sign = tomove == Color::WHITE ? 1.0f : -1.0f;
+    if (score >= SCORE_MATE - MAX_PLY) {
+        // Side to move delivers checkmate
+        return eval(sign * INFINITY, (SCORE_MATE - score + 1) / 2);
+    } else if (score <= -SCORE_MATE + MAX_PLY) {
+        // Side to move is checkmated
+        return eval(-sign * INFINITY, (SCORE_MATE + score + 1) / 2);
+    }
+    return eval(sign * score / 100.0f);
+}
+
+// Type of bound a stored score is
+enum Bound {
+    BOUND_NONE   = 0,
+    // Score is an upper bound (the search failed low)
+    BOUND_UPPER  = 1,
+    // Score is a lower bound (the search failed high)
+    BOUND_LOWER  = 2,
+    // Score is exact
+    BOUND_EXACT  = 3,
+};
+
+// cce::ttdata - Unpacked transposition table entry
+//
+//
+struct ttdata {
+
+    // Best (or refuting) move found, which may be bad
+    move mv;
+
+    // Score of the position, and what kind of bound it is
+    int score;
+    Bound bound;
+
+    // Depth the position was searched to
+    int depth;
+
+};
+
+// cce::ttentry - Packed transposition table entry (16 bytes)
+//
+// 'data' holds the move in bits 0-15, the score in bits 16-31, the (unsigned) depth in bits 32-39,
+//   the bound in bits 40-41, and the age in bits 42-47
+// 'check' holds 'key ^ data', so an entry torn by two threads writing at the same time fails the
+//   check and is just a miss, which is why no locking is needed
+//
+struct ttentry {
+    atomic<uint64_t> check, data;
+};
+
+// Number of entries in a cluster, which fill a 64 byte cache line
+#define TT_CLUSTER 4
+
+// cce::ttcluster - Group of entries that a key may be stored in
+struct ttcluster {
+    ttentry entries[TT_CLUSTER];
+};
+
+// Default (and maximum) size of the transposition table, in megabytes
+#define TT_DEFAULT_MB 16
+#define TT_MAX_MB 65536
+
+// cce::TransTable - Transposition table, shared between search threads
+//
+//
+struct TransTable {
+
+    // Clusters (aligned to 64 bytes, inside of 'mem'), and the mask to index them by key
+    ttcluster* clusters;
+    size_t mask;
+    char* mem;
+
+    // Age of the current search, so entries from old searches are replaced first
+    int age;
+
+    TransTable(size_t mb=TT_DEFAULT_MB);
+    ~TransTable();
+
+    // Reallocate to about 'mb' megabytes (rounded down to a power of two clusters) and clear it
+    void resize(size_t mb);
+
+    // Remove all entries
+    void clear();
+
+    // Start a new search
+    void newsearch() { age = (age + 1) & 63; }
+
+    // Look up 'key', returning whether it was found (and filling 'res' if so)
+    bool probe(uint64_t key, ttdata& res) const;
+
+    // Store an entry for 'key'
+    void store(uint64_t key, move mv, int score, int depth, Bound bound);
+
+};
+
+struct Engine;
+
+// cce::Searcher - A single search thread
+//
+// Each thread has its own 'Searcher', and they only share the engine's transposition table
+//
+struct Searcher {
+
+    // Engine being searched for
+    Engine& eng;
+
+    // Index of this thread, where 0 is the main thread (which is the one that publishes results)
+    int id;
+
+    // Number of nodes (positions that a move was made into) searched, and how many of those were
+    //   in the quiescence search
+    size_t nodes, qnodes;
+
+    // Whether the search has been stopped, which is only checked every 'STOP_CHECK_NODES'
+    bool stopped;
+
+    // Beta cutoffs in the main search, and how many of those were by the first move searched
+    //   (which is a measure of how good move ordering is)
+    size_t cutoffs, cutoffs_first;
+
+    // Copy of 'nodes' for other threads to read, which is updated every 'STOP_CHECK_NODES'
+    atomic<size_t> nodes_pub;
+
+    // Deepest ply reached in the current iteration
+    int seldepth;
+
+    // Triangular principal variation array, where 'pv[ply]' holds the best line found from the
+    //   node at 'ply', which is in 'pv[ply][ply]' to 'pv[ply][pvlen[ply] - 1]'
+    move pv[MAX_PLY + 1][MAX_PLY + 1];
+    int pvlen[MAX_PLY + 1];
+
+    // Principal variation of the last completed iteration
+    vector<move> rootpv;
+
+    // Moves made at each ply on the way to the current node
+    move stack[MAX_PLY + 1];
+
+    // Killer moves for each ply, which are the last two quiet moves that caused a cutoff there
+    move killers[MAX_PLY + 1][2];
+
+    // Countermoves, which are the quiet moves that last caused a cutoff right after the opponent's
+    //   move, indexed by that move's [from][to]
+    move countermoves[64][64];
+
+    // History scores, indexed by [color][from][to], which go up for quiet moves that cause cutoffs
+    //   and down for ones that were tried before them (see 'HISTORY_MAX')
+    int history[N_COLORS][64][64];
+
+    Searcher(Engine& eng_, int id_);
+
+    // Check whether the search should stop, setting 'stopped' if so
+    void checkstop();
+
+    // Record 'mv' as the best move at 'ply', followed by the principal variation of the child
+    void update_pv(move mv, int ply) {
+        pv[ply][ply] = mv;
+        for (int i = ply + 1; i < pvlen[ply + 1]; ++i) {
+            pv[ply][i] = pv[ply + 1][i];
+        }
+        pvlen[ply] = max(pvlen[ply + 1], ply + 1);
+    }
+
+    // Update the ordering heuristics after the quiet move 'mv' caused a cutoff at 'ply' in 's',
+    //   searched to 'dep', where 'tried' are the quiet moves that were searched before it
+    void update_quiet(const State& s, move mv, const movelist& tried, int dep, int ply);
+
+    // Negamax alpha-beta search of 's' to 'dep' plies, which is 'ply' plies from the root
+    // Returns the score of 's' (see 'SCORE_MATE'), which is exact if it is within (alpha, beta),
+    //   and otherwise only a bound
+    // NOTE: Moves are made and unmade on 's', so it is the same when this returns
+    // Nodes with a window wider than a null window ('beta - alpha > 1') are PV nodes, where the
+    //   exact score matters, and so they aren't pruned as aggressively
+    int search(State& s, int alpha, int beta, int dep, int ply);
+
+    // Search the root position 's' to 'dep' plies within (alpha, beta), trying 'first' first
+    // Fills in 'pv[0]' if a move scored within the window
+    // NOTE: Moves are made and unmade on 's', so it is the same when this returns
+    int searchroot(State& s, int alpha, int beta, int dep, move first);
+
+    // Quiescence search of 's', which is 'ply' plies from the root, only trying captures and
+    //   promotions (or every move, if in check) until the position is quiet
+    // The side to move may 'stand pat' (take the static evaluation) instead of capturing, since
+    //   there is usually a quiet move at least that good
+    // NOTE: Moves are made and unmade on 's', so it is the same when this returns
+    int qsearch(State& s, int alpha, int beta, int ply);
+
+    // Iterative deepening, searching to depth 1, 2, ..., 'maxdep', and returning the best move
+    //   and its score from the last completed iteration
+    // The main thread also checks the engine's limits and time manager, and ends the search
+    // The main thread publishes each completed iteration to the engine, and helper threads skip
+    //   some depths (depending on 'id') so that they aren't all searching the same thing
+    // NOTE: Moves are made and unmade on 's', so it is the same when this returns
+    pair<move, int> iterdeep(State& s, int maxdep);
+
+    // Returns a UCI 'info' line for the iteration to 'dep' that just completed
+    string info(int dep);
+
+};
+
+// Bound on history scores, which updates approach smoothly (the 'gravity' formula), so that old
+//   scores fade out instead of saturating
+#define HISTORY_MAX 16384
+
+// Aspiration windows start this wide (in centipawns) around the last iteration's score, from
+//   'ASP_DEPTH' on, and double on each side that fails
+#define ASP_DEPTH 4
+#define ASP_WINDOW 30
+
+// Maximum number of search threads
+#define MAX_THREADS 256
+
+// How often (in nodes) search threads check whether they should stop, which must be a power of two
+#define STOP_CHECK_NODES 1024
+
+// cce::limits - Limits on a search, given by the 'go' command
+//
+//
+struct limits {
+
+    // Maximum depth to search to
+    int depth = MAX_PLY;
+
+    // Maximum number of nodes to search (0 for no limit)
+    size_t nodes = 0;
+
+    // Exact time to search for, in milliseconds (0 for no limit)
+    int movetime = 0;
+
+    // Time left on each side's clock, and their increments, in milliseconds
+    // A clock may be zero or negative (i.e. from a lagging GUI), so whether it was given is kept
+    //   separately in 'hastime'
+    int time[N_COLORS] = { 0, 0 };
+    bool hastime[N_COLORS] = { false, false };
+    int inc[N_COLORS] = { 0, 0 };
+
+    // Moves until the next time control (0 if not given, which means sudden death)
+    int movestogo = 0;
+
+    // Whether to search until told to stop
+    bool infinite = false;
+
+};
+
+// Time (in milliseconds) held back on every move, for communication delays
+#define TM_OVERHEAD 30
+
+// Number of moves the remaining time is budgeted for, if 'movestogo' is not given
+#define TM_MOVESTOGO 30
+
+// cce::TimeManager - Decides how long a search may take
+//
+// There is a soft limit, after which no new iterations are started (which is scaled by how stable
+//   the best move is), and a hard limit, after which the search is stopped in the middle
+//
+struct TimeManager {
+
+    // When the search started
+    chrono::steady_clock::time_point start;
+
+    // Soft and hard limits, in milliseconds since 'start' (-1 for no limit)
+    int soft, hard;
+
+    TimeManager() : soft(-1), hard(-1) {}
+
+    // Start timing a search with 'lim', where 'us' is the side to move
+    void init(const limits& lim, Color us);
+
+    // Milliseconds since 'start'
+    int elapsed() const {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Whether the search must stop now
+    bool hard_exceeded() const { return hard >= 0 && elapsed() >= hard; }
+
+    // Whether no new iteration should be started, given that the best move has stayed the same for
+    //   the last 'stable' iterations
+    bool soft_exceeded(int stable) const;
+
+};
+
 
 // cce::Engine - Chess engine implementation
 //
@@ -443,34 +1057,115 @@ struct Engine {
     // Computing thread which runs the number crunching
     thread thd_compute;
 
-    // The current best move for the starting position
-    // NOTE: Check 'isbad()' to see if it is uninitialized
-    move best_move;
+    // Lock for writing to 'cout', since the search thread writes to it as well
+    mutex lock_out;
 
-    // The evaluation for 'best_move'
-    eval best_ev;
+    // The current best move for the starting position and its score (for the side to move), packed
+    //   as the move in bits 0-15, the score in bits 16-31, and the depth in bits 32-47
+    // This is atomic (instead of being under 'lock') so it can be read at any time during a search
+    atomic<uint64_t> best;
 
     // Current state the engine is analyzing
     State state;
 
+    // Number of nodes (positions that a move was made into) searched by all threads, and how many
+    //   of those were in the quiescence search
+    size_t nodes = 0, qnodes = 0;
+
+    // Beta cutoffs in the main search by all threads, and how many were by the first move
+    size_t cutoffs = 0, cutoffs_first = 0;
+
+    // Transposition table, shared by all threads
+    TransTable tt;
+
+    // Number of threads to search with
+    int nthreads = 1;
+
+    // Searchers of the current search (where the first is the main thread)
+    vector<Searcher*> searchers;
+
+    // Whether to print UCI 'info' lines after each iteration
+    bool verbose = false;
+
+    // Principal variation for 'best_move()' (which is its first move), under 'lock'
+    vector<move> best_pv;
+
+    // Which selective search techniques are enabled (see 'Searcher::search()')
+    bool opt_nmp = true, opt_lmr = true, opt_rfp = true, opt_fp = true;
+
+    // Set by 'stop()' to stop the search threads, which check it every 'STOP_CHECK_NODES' nodes
+    atomic<bool> stopping;
+
+    // Set once the current search should end, either because the main thread finished or because
+    //   it ran out of time or nodes (which stops the other threads the same way as 'stopping')
+    atomic<bool> done;
+
+    // Limits and time manager of the current search
+    limits lim;
+    TimeManager tm;
+
+    Engine() : best(0), stopping(false), done(false) {}
+    ~Engine();
+
     // Set the current state the engine should analyze
     void setstate(const State& state_);
 
-    // Start computing the current position
-    void go();
+    // Start computing the current position on 'thd_compute' within 'lim_', and return immediately
+    // When the search finishes (or is stopped), the search thread prints 'bestmove'
+    // NOTE: With 'lim_.infinite', 'bestmove' is not printed until 'stop()'
+    void go(const limits& lim_);
 
-    // Stop computing the current position
+    // Stop computing the current position, and wait for the search thread to finish
     void stop();
 
+    // Write 'line' to 'cout', without interleaving with other threads
+    void print(const string& line);
+
+    // Publish the best move so far
+    void setbest(move mv, int score, int depth) {
+        best = (uint64_t)mv.bits | (uint64_t)(uint16_t)(int16_t)score << 16 | (uint64_t)(uint16_t)depth << 32;
+    }
+
+    // Returns a copy of 'best_pv'
+    vector<move> getpv();
+
+    // Number of nodes searched so far by all threads (which is approximate while searching)
+    size_t nodes_now() const;
+
+    // Best move so far, which is bad if there is none
+    move best_move() const {
+        move res;
+        res.bits = best.load() & 0xFFFF;
+        return res;
+    }
+
+    // Score of 'best_move()', for the side to move
+    int best_score() const { return (int16_t)(uint16_t)(best.load() >> 16); }
+
+    // Depth that 'best_move()' was found at
+    int best_depth() const { return (uint16_t)(best.load() >> 32); }
+
+    // Start a new game, forgetting everything from previous searches
+    void newgame();
+
+    // Returns whether 'name' is a UCI option that 'setoption()' accepts
+    bool hasoption(const string& name) const;
+
+    // Set the UCI option 'name' to 'value', returning whether it was a valid option with a valid
+    //   value (otherwise nothing is changed)
+    bool setoption(const string& name, const string& value);
+
 
     // Static evaluation method, which does not recurse or check move combinations
     eval eval_static(const State& s);
 
-    // Find the best move, by using the evaluation function with a single move depth
-    pair<move, eval> findbest1(const State& s);
-
-    // Find the best move with a given depth, brute force search
-    pair<move, eval> findbestN(const State& s, int dep=1);
+    // Find the best move with iterative deepening, searching to depth 1, 2, ..., until 'lim_' or
+    //   the time manager says to stop
+    // The search uses 'nthreads' threads (Lazy SMP), which share the transposition table, and the
+    //   main thread's result is used
+    // Each completed iteration is published (see 'setbest'), so there is always a result
+    // If 'verbose_', 'info' lines are printed after each iteration
+    pair<move, eval> findbest(const State& s, const limits& lim_, bool verbose_=false);
 
 };
 
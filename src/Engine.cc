@@ -7,43 +7,138 @@
 
 namespace cce {
 
+Engine::~Engine() {
+    if (thd_compute.joinable()) {
+        stopping = true;
+        thd_compute.join();
+    }
+}
+
 void Engine::setstate(const State& state_) {
     lock.lock();
 
     state = state_;
 
     // Initialize to bad moves
-    best_move = move();
-    best_ev = eval(0.0f);
+    setbest(move(), 0, 0);
+    best_pv.clear();
 
     lock.unlock();
 }
 
-void Engine::go() {
+void Engine::go(const limits& lim_) {
+    // Only one search at a time
+    stop();
+
     lock.lock();
-    
-    // Search for best move
-    best_move = findbestN(state, 2).first;
+    State s = state;
+    lock.unlock();
 
-    //for (int i = 0; i < moves.size(); ++i) {
-    //    cout << moves[i].LAN() << endl;
-    //}
+    // Set before the thread starts, so a 'stop()' right after this isn't lost
+    stopping = false;
+    tt.newsearch();
 
-    lock.unlock();
+    thd_compute = thread([this, s, lim_]() {
+        pair<move, eval> res = findbest(s, lim_, true);
+
+        // An infinite search may finish early (i.e. finding a checkmate), but must still wait
+        while (lim_.infinite && !stopping) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+
+        print("bestmove " + res.first.LAN());
+    });
 }
 
 void Engine::stop() {
+    if (thd_compute.joinable()) {
+        // The search thread checks this every 'STOP_CHECK_NODES', so it stops quickly
+        stopping = true;
+        thd_compute.join();
+    }
+}
+
+void Engine::print(const string& line) {
+    lock_out.lock();
+    cout << line << endl;
+    lock_out.unlock();
+}
+
+vector<move> Engine::getpv() {
     lock.lock();
+    vector<move> res = best_pv;
+    lock.unlock();
+    return res;
+}
 
-    // TODO: Kill thread here
-    
-    // For now, just output 'e2e4'
-    //best_move = move(TILE(4, 1), TILE(4, 3));
-    //best_ev = eval(1.0f);
+size_t Engine::nodes_now() const {
+    size_t res = 0;
+    for (int i = 0; i < searchers.size(); ++i) {
+        res += searchers[i]->nodes_pub.load(memory_order_relaxed);
+    }
+    return res;
+}
+
+void Engine::newgame() {
+    lock.lock();
+
+    tt.clear();
+    setbest(move(), 0, 0);
+    best_pv.clear();
 
     lock.unlock();
 }
 
+// Names of the options that 'setoption()' accepts
+static const char* i_options[] = { "Hash", "Threads", "NullMove", "LMR", "ReverseFutility", "Futility" };
+
+bool Engine::hasoption(const string& name) const {
+    for (int i = 0; i < sizeof(i_options) / sizeof(*i_options); ++i) {
+        if (name == i_options[i]) return true;
+    }
+    return false;
+}
+
+bool Engine::setoption(const string& name, const string& value) {
+    if (name == "Hash") {
+        // Size of the transposition table, in megabytes
+        int mb;
+        if (!parse_int(value, mb)) return false;
+        mb = max(1, min(mb, TT_MAX_MB));
+
+        // The search threads use the table without locking, so it can't be freed under them
+        stop();
+
+        lock.lock();
+        tt.resize(mb);
+        lock.unlock();
+        return true;
+    }
+    if (name == "Threads") {
+        // Number of search threads
+        int n;
+        if (!parse_int(value, n)) return false;
+
+        lock.lock();
+        nthreads = max(1, min(n, MAX_THREADS));
+        lock.unlock();
+        return true;
+    }
+
+    // Toggles for each selective search technique
+    bool* opt = name == "NullMove" ? &opt_nmp : name == "LMR" ? &opt_lmr : name == "ReverseFutility" ? &opt_rfp : name == "Futility" ? &opt_fp : NULL;
+    if (opt) {
+        if (value != "true" && value != "false") return false;
+
+        lock.lock();
+        *opt = value == "true";
+        lock.unlock();
+        return true;
+    }
+
+    return false;
+}
+
 // Scores for each piece
 #define SCORE_Q (9.0)
 #define SCORE_B (3.15)
@@ -89,7 +184,7 @@ static float db_centerval[64] = {
 
 
 // Attack and defense score for a list of moves
-static float my_adscore(const Engine& eng, const State& s, const vector<move>& moves) {
+static float my_adscore(const Engine& eng, const State& s, const movelist& moves) {
     
     // Count number of legal moves to a given square
     int numto[64];
@@ -101,22 +196,17 @@ static float my_adscore(const Engine& eng, const State& s, const vector<move>& m
     for (int i = 0; i < moves.size(); ++i) {
         // Compute extra score based on number of defenders
         // 0.3f is just a magic constant... expirement with this!
-        float numbonus = numto[moves[i].to] * 0.3f;
+        float numbonus = numto[moves[i].to()] * 0.3f;
 
         // Add the center value and the bonus
-        res += MULT_TOPOS * db_centerval[moves[i].to] * (1 + numbonus);
-        numto[moves[i].to]++;
+        res += MULT_TOPOS * db_centerval[moves[i].to()] * (1 + numbonus);
+        numto[moves[i].to()]++;
     }
 
     // Also, bonus points of the enemy king is attacked
     Color other = s.tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
 
-    int ntiles;
-    int tiles[64];
-    ntiles = bbtiles(s.piece[Piece::K] & s.color[other], tiles);
-    assert(ntiles == 1); // Must have one king!
-
-    if (s.is_attacked(tiles[0])) {
+    if (s.is_attacked(lsb(s.piece[Piece::K] & s.color[other]))) {
         // Other king is attacked
         res += SCORE_CHECK;
     }
@@ -126,10 +216,6 @@ static float my_adscore(const Engine& eng, const State& s, const vector<move>& m
 
 // Calculate a score for a particular color
 static float my_score(const Engine& eng, const State& s, Color c) {
-    // Positions of each piece
-    int ntiles;
-    int tiles[64];
-
     // Total material score for this color
     float mat = 0.0f;
 
@@ -139,34 +225,29 @@ static float my_score(const Engine& eng, const State& s, Color c) {
     // Positional score
     float pos = 0.0f;
 
-    ntiles = bbtiles(s.color[c] & s.piece[Piece::Q], tiles);
-    for (int i = 0; i < ntiles; ++i) {
+    for (int tile : bbtiles(s.color[c] & s.piece[Piece::Q])) {
         mat += SCORE_Q;
-        pos += (SCORE_Q * MULT_INPOS + ADD_INPOS) * db_centerval[tiles[i]];
+        pos += (SCORE_Q * MULT_INPOS + ADD_INPOS) * db_centerval[tile];
     }
 
-    ntiles = bbtiles(s.color[c] & s.piece[Piece::B], tiles);
-    for (int i = 0; i < ntiles; ++i) {
+    for (int tile : bbtiles(s.color[c] & s.piece[Piece::B])) {
         mat += SCORE_B;
-        pos += (SCORE_B * MULT_INPOS + ADD_INPOS) * db_centerval[tiles[i]];
+        pos += (SCORE_B * MULT_INPOS + ADD_INPOS) * db_centerval[tile];
     }
 
-    ntiles = bbtiles(s.color[c] & s.piece[Piece::N], tiles);
-    for (int i = 0; i < ntiles; ++i) {
+    for (int tile : bbtiles(s.color[c] & s.piece[Piece::N])) {
         mat += SCORE_N;
-        pos += (SCORE_N * MULT_INPOS + ADD_INPOS) * db_centerval[tiles[i]];
+        pos += (SCORE_N * MULT_INPOS + ADD_INPOS) * db_centerval[tile];
     }
 
-    ntiles = bbtiles(s.color[c] & s.piece[Piece::R], tiles);
-    for (int i = 0; i < ntiles; ++i) {
+    for (int tile : bbtiles(s.color[c] & s.piece[Piece::R])) {
         mat += SCORE_R;
-        pos += (SCORE_R * MULT_INPOS + ADD_INPOS) * db_centerval[tiles[i]];
+        pos += (SCORE_R * MULT_INPOS + ADD_INPOS) * db_centerval[tile];
     }
 
-    ntiles = bbtiles(s.color[c] & s.piece[Piece::P], tiles);
-    for (int i = 0; i < ntiles; ++i) {
+    for (int tile : bbtiles(s.color[c] & s.piece[Piece::P])) {
         mat += SCORE_P;
-        pos += (SCORE_P * MULT_INPOS + ADD_INPOS) * db_centerval[tiles[i]];
+        pos += (SCORE_P * MULT_INPOS + ADD_INPOS) * db_centerval[tile];
     }
 
     // Castling rights
@@ -180,7 +261,7 @@ static float my_score(const Engine& eng, const State& s, Color c) {
 
 
     if (s.tomove == c) {
-        vector<move> moves;
+        movelist moves;
         s.getmoves(moves);
 
         pos += SCORE_PERMOVE * moves.size();
@@ -193,7 +274,7 @@ static float my_score(const Engine& eng, const State& s, Color c) {
         State ns = s;
         ns.tomove = c;
 
-        vector<move> moves;
+        movelist moves;
         ns.getmoves(moves);
 
         pos += SCORE_PERMOVE * moves.size();
@@ -239,82 +320,56 @@ eval Engine::eval_static(const State& s) {
     fclose(fp); \
 } while (0)
 
-pair<move, eval> Engine::findbest1(const State& s) {
-    // Find legal moves
-    vector<move> moves;
-    s.getmoves(moves);
-    // Return NULL move
-    if (moves.size() == 0) return {move(), eval()};
+pair<move, eval> Engine::findbest(const State& s, const limits& lim_, bool verbose_) {
+    lim = lim_;
+    verbose = verbose_;
+    tm.init(lim, s.tomove);
+    done = false;
 
-    // Best index
-    int bi = -1;
-    eval be = eval();
-    for (int i = 0; i < moves.size(); ++i) {
+    int maxdep = lim.depth;
 
-        // Try applying the move
-        State ns = s;
-        ns.apply(moves[i]);
-        eval ev = eval_static(ns);
-        if (bi < 0) {
-            bi = i;
-            be = ev;
-        } else if (s.tomove == Color::WHITE) {
-            if (eval::cmp(ev, be) > 0) {
-                bi = i;
-                be = ev;
-            }
-        } else if (s.tomove == Color::BLACK) {
-            if (eval::cmp(ev, be) < 0) {
-                bi = i;
-                be = ev;
-            }
-        }
+    // Helper threads search the same position with their own 'Searcher', and are only useful for
+    //   what they leave in the transposition table
+    int n = max(1, min(nthreads, MAX_THREADS));
+    vector<thread> helpers;
+    for (int i = 0; i < n; ++i) {
+        searchers.push_back(new Searcher(*this, i));
+    }
+    for (int i = 1; i < n; ++i) {
+        Searcher* sr = searchers[i];
+        helpers.push_back(thread([sr, &s, maxdep]() {
+            State hs = s;
+            sr->iterdeep(hs, maxdep);
+        }));
     }
 
-    return {moves[bi], be};
-}
+    State ms = s;
+    pair<move, int> res = searchers[0]->iterdeep(ms, maxdep);
 
-pair<move, eval> Engine::findbestN(const State& s, int dep) {
-    // Base case to end recursion
-    if (dep <= 1) return findbest1(s);
+    // Now that the main thread is done, stop the helpers
+    done = true;
+    for (int i = 0; i < helpers.size(); ++i) {
+        helpers[i].join();
+    }
+
+    nodes = qnodes = cutoffs = cutoffs_first = 0;
+    for (int i = 0; i < n; ++i) {
+        nodes += searchers[i]->nodes;
+        qnodes += searchers[i]->qnodes;
+        cutoffs += searchers[i]->cutoffs;
+        cutoffs_first += searchers[i]->cutoffs_first;
+        delete searchers[i];
+    }
+    searchers.clear();
 
-    // Otherwise, let's search through all possible moves
-    vector<move> moves;
-    s.getmoves(moves);
-    if (moves.size() == 0) {
-        // Need to handle ended games
+    if (res.first.isbad()) {
+        // No legal moves, so the game is over
         int status;
         s.is_done(status);
-
-        return pair<move, eval>(move(), eval(INFINITY * status, 0));
+        return pair<move, eval>(move(), status == 0 ? eval::draw() : eval(INFINITY * status, 0));
     }
 
-    // Best index
-    int bi = -1;
-    eval be = eval();
-    for (int i = 0; i < moves.size(); ++i) {
-        State ns = s;
-        ns.apply(moves[i]);
-
-        // Find best move in new position
-        pair<move, eval> bm = findbestN(ns, dep-1);
-        if (bi < 0) {
-            bi = i;
-            be = bm.second;
-        } else if (s.tomove == Color::WHITE) {
-            if (eval::cmp(bm.second, be) > 0) {
-                bi = i;
-                be = bm.second;
-            }
-        } else if (s.tomove == Color::BLACK) {
-            if (eval::cmp(bm.second, be) < 0) {
-                bi = i;
-                be = bm.second;
-            }
-        }
-    }
-    
-    return {moves[bi], be};
+    return {res.first, score_toeval(res.second, s.tomove)};
 }
 
 
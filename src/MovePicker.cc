@@ -0,0 +1,130 @@
+/* MovePicker.cc - Implementation of 'cce::MovePicker'
+ *
+ * @author: Cade Brown <cade@cade.site>
+ */
+
+#include <cce.hh>
+
+namespace cce {
+
+// Rough order of piece values for MVV-LVA (indexed by 'Piece::*'), where higher is more valuable
+static const int i_mvvlva[N_PIECES] = {
+    // K, Q, B, N, R, P
+    6, 5, 3, 2, 4, 1,
+};
+
+MovePicker::MovePicker(const State& s_, move hashmove_, const move* killers_, bool noisyonly_, move countermove_, const int (*history_)[64]) : s(s_) {
+    hashmove = hashmove_;
+    killers[0] = killers_ ? killers_[0] : move();
+    killers[1] = killers_ ? killers_[1] : move();
+    countermove = countermove_;
+    history = history_;
+    noisyonly = noisyonly_;
+    stage = STAGE_HASH;
+    idx = 0;
+}
+
+// Returns whether 'mv' would be generated by the noisy stage
+static bool i_isnoisy(const move& mv) {
+    return mv.iscapture() || mv.ispromo();
+}
+
+move MovePicker::next() {
+    switch (stage) {
+    case STAGE_HASH:
+        stage = STAGE_NOISY_GEN;
+
+        // The hash move didn't come from the generator, so it may not even be legal
+        //   in this position (i.e. because of a hash collision)
+        if (s.is_legal(hashmove) && (!noisyonly || i_isnoisy(hashmove))) {
+            return hashmove;
+        }
+        hashmove = move();
+
+        // fallthrough
+    case STAGE_NOISY_GEN:
+        s.getmoves(moves, Gen::GEN_NOISY);
+        for (int i = 0; i < moves.size(); ++i) {
+            // Most valuable victim first, and then least valuable attacker
+            const move& mv = moves[i];
+            int victim = mv.flags() == MF_EP ? Piece::P : s.board[mv.to()];
+            scores[i] = 8 * (victim >= 0 ? i_mvvlva[victim] : 0) - i_mvvlva[s.board[mv.from()]];
+
+            // Promotions gain the new piece
+            if (mv.ispromo()) scores[i] += 8 * i_mvvlva[mv.promo()];
+        }
+        idx = 0;
+        stage = STAGE_NOISY;
+
+        // fallthrough
+    case STAGE_NOISY:
+        while (idx < moves.size()) {
+            // Selection sort, which only sorts as far as we get
+            int bi = idx;
+            for (int i = idx + 1; i < moves.size(); ++i) {
+                if (scores[i] > scores[bi]) bi = i;
+            }
+            swap(moves[idx], moves[bi]);
+            swap(scores[idx], scores[bi]);
+
+            move mv = moves[idx++];
+            if (mv != hashmove) return mv;
+        }
+        if (noisyonly) {
+            stage = STAGE_DONE;
+            return move();
+        }
+        idx = 0;
+        stage = STAGE_KILLERS;
+
+        // fallthrough
+    case STAGE_KILLERS:
+        // The countermove is tried after the killers, as if it were a third one
+        while (idx < 3) {
+            move mv = idx < 2 ? killers[idx] : countermove;
+            idx++;
+            if (mv.isbad() || mv == hashmove || i_isnoisy(mv)) continue;
+            if (idx >= 2 && mv == killers[0]) continue;
+            if (idx == 3 && mv == killers[1]) continue;
+
+            // These came from a different position, so they must be checked too
+            if (s.is_legal(mv)) return mv;
+        }
+        stage = STAGE_QUIET_GEN;
+
+        // fallthrough
+    case STAGE_QUIET_GEN:
+        s.getmoves(moves, Gen::GEN_QUIET);
+        for (int i = 0; i < moves.size(); ++i) {
+            scores[i] = history ? history[moves[i].from()][moves[i].to()] : 0;
+        }
+        idx = 0;
+        stage = STAGE_QUIET;
+
+        // fallthrough
+    case STAGE_QUIET:
+        while (idx < moves.size()) {
+            if (history) {
+                // Selection sort, same as captures
+                int bi = idx;
+                for (int i = idx + 1; i < moves.size(); ++i) {
+                    if (scores[i] > scores[bi]) bi = i;
+                }
+                swap(moves[idx], moves[bi]);
+                swap(scores[idx], scores[bi]);
+            }
+
+            move mv = moves[idx++];
+            if (mv != hashmove && mv != killers[0] && mv != killers[1] && mv != countermove) return mv;
+        }
+        stage = STAGE_DONE;
+
+        // fallthrough
+    case STAGE_DONE:
+    default:
+        return move();
+    }
+}
+
+
+}
@@ -0,0 +1,496 @@
+/* Searcher.cc - Implementation of 'cce::Searcher'
+ *
+ * Multiple threads search at once with Lazy SMP, where every thread searches the same root
+ *   position, sharing only the transposition table. Helper threads skip some depths, so they
+ *   search different parts of the tree, and fill in the table for the main thread
+ *
+ * SEE: https://www.chessprogramming.org/Lazy_SMP
+ *
+ * @author: Cade Brown <cade@cade.site>
+ */
+
+#include <cce.hh>
+
+namespace cce {
+
+Searcher::Searcher(Engine& eng_, int id_) : eng(eng_) {
+    id = id_;
+    nodes = qnodes = 0;
+    nodes_pub = 0;
+    stopped = false;
+    cutoffs = cutoffs_first = 0;
+    seldepth = 0;
+
+    for (int i = 0; i <= MAX_PLY; ++i) {
+        stack[i] = killers[i][0] = killers[i][1] = move();
+        pvlen[i] = 0;
+    }
+    for (int c = 0; c < N_COLORS; ++c) {
+        for (int i = 0; i < 64; ++i) {
+            for (int j = 0; j < 64; ++j) {
+                if (c == 0) countermoves[i][j] = move();
+                history[c][i][j] = 0;
+            }
+        }
+    }
+}
+
+// Convert an 'eval' into a search score for the side to move, 'tomove', which is 'ply' plies from the root
+static int i_fromeval(const eval& ev, Color tomove, int ply) {
+    float sign = tomove == Color::WHITE ? 1.0f : -1.0f;
+    if (ev.isdraw()) {
+        return 0;
+    } else if (ev.ismate()) {
+        return sign * ev.score > 0 ? SCORE_MATE - ply : -SCORE_MATE + ply;
+    }
+    return (int)roundf(sign * ev.score * 100.0f);
+}
+
+// Mate scores are stored in the transposition table relative to the position instead of the root,
+//   since the same position may be reached at a different ply
+static int i_tostore(int score, int ply) {
+    if (score >= SCORE_MATE - MAX_PLY) return score + ply;
+    if (score <= -SCORE_MATE + MAX_PLY) return score - ply;
+    return score;
+}
+
+static int i_fromstore(int score, int ply) {
+    if (score >= SCORE_MATE - MAX_PLY) return score - ply;
+    if (score <= -SCORE_MATE + MAX_PLY) return score + ply;
+    return score;
+}
+
+void Searcher::checkstop() {
+    nodes_pub.store(nodes, memory_order_relaxed);
+
+    if (id == 0) {
+        // Only the main thread checks the limits, and it ends the search for everyone
+        // The node limit counts all threads, the same as the 'info' lines
+        if (eng.tm.hard_exceeded() || (eng.lim.nodes > 0 && eng.nodes_now() >= eng.lim.nodes)) eng.done = true;
+    }
+
+    if (eng.stopping.load(memory_order_relaxed) || eng.done.load(memory_order_relaxed)) stopped = true;
+}
+
+// Reverse futility pruning is used up to this depth, with a margin (in centipawns) per ply
+#define RFP_DEPTH 3
+#define RFP_MARGIN 120
+
+// Futility pruning is used up to this depth, with a margin (in centipawns) per ply
+#define FP_DEPTH 2
+#define FP_MARGIN 150
+
+// Late move reductions are used from this depth, after this many moves
+#define LMR_DEPTH 3
+#define LMR_MOVES 3
+
+// Late move reductions, indexed by [depth][move number], which grow slowly with both
+static struct i_lmrtable {
+    int r[64][64];
+
+    i_lmrtable() {
+        for (int d = 0; d < 64; ++d) {
+            for (int m = 0; m < 64; ++m) {
+                r[d][m] = d == 0 || m == 0 ? 0 : (int)(0.75 + log(d) * log(m) / 2.25);
+            }
+        }
+    }
+} i_lmr;
+
+// Apply a 'bonus' (which may be negative) to a history score, where the change shrinks as the
+//   score gets closer to 'HISTORY_MAX' in that direction
+static void i_gravity(int& h, int bonus) {
+    h += bonus - h * abs(bonus) / HISTORY_MAX;
+}
+
+void Searcher::update_quiet(const State& s, move mv, const movelist& tried, int dep, int ply) {
+    if (killers[ply][0] != mv) {
+        killers[ply][1] = killers[ply][0];
+        killers[ply][0] = mv;
+    }
+
+    if (ply > 0 && !stack[ply-1].isbad()) {
+        countermoves[stack[ply-1].from()][stack[ply-1].to()] = mv;
+    }
+
+    // Deeper cutoffs are more certain, so they count for more
+    int bonus = min(16 * dep * dep, HISTORY_MAX / 8);
+    i_gravity(history[s.tomove][mv.from()][mv.to()], bonus);
+    for (int i = 0; i < tried.size(); ++i) {
+        i_gravity(history[s.tomove][tried[i].from()][tried[i].to()], -bonus);
+    }
+}
+
+int Searcher::search(State& s, int alpha, int beta, int dep, int ply) {
+    pvlen[ply] = ply;
+
+    // The score doesn't matter once the search is stopped, since it won't be used
+    if ((nodes & (STOP_CHECK_NODES - 1)) == 0) checkstop();
+    if (stopped) return 0;
+
+    // Resolve captures at the leaves, so they aren't evaluated in the middle of an exchange
+    if (dep <= 0 || ply >= MAX_PLY) return qsearch(s, alpha, beta, ply);
+
+    // Fifty move rule
+    if (s.hmclock >= 100) return 0;
+
+    seldepth = max(seldepth, ply);
+    bool pvnode = beta - alpha > 1;
+
+    // Check for a previous search of this position, which may be deep enough to use the score of
+    //   directly, and otherwise still gives a good move to try first
+    // PV nodes don't take cutoffs, so that the principal variation isn't cut short
+    int alpha0 = alpha;
+    move ttmove;
+    ttdata tte;
+    if (eng.tt.probe(s.key, tte)) {
+        ttmove = tte.mv;
+        if (!pvnode && tte.depth >= dep) {
+            int score = i_fromstore(tte.score, ply);
+            if (tte.bound == BOUND_EXACT || (tte.bound == BOUND_LOWER && score >= beta) || (tte.bound == BOUND_UPPER && score <= alpha)) {
+                return score;
+            }
+        }
+    }
+
+    bool check = s.in_check();
+
+    // Static evaluation, which decides what can be pruned (and isn't meaningful while in check)
+    int ev = check ? -SCORE_INF : i_fromeval(eng.eval_static(s), s.tomove, ply);
+
+    // Reverse futility pruning: near the leaves, if we're so far above beta that the opponent
+    //   is unlikely to catch up in the remaining plies, just assume a cutoff
+    if (eng.opt_rfp && !pvnode && !check && dep <= RFP_DEPTH && !score_ismate(beta) && ev - RFP_MARGIN * dep >= beta) {
+        return ev;
+    }
+
+    // Null move pruning: if we're still above beta after giving the opponent a free move (searched
+    //   shallower), then a real move almost certainly is too
+    // This is wrong in zugzwang (where any move makes things worse), which is mostly in endings
+    //   with only pawns, so those are skipped. Two null moves in a row are never tried
+    bb pieces = s.color[s.tomove] & ~(s.piece[Piece::P] | s.piece[Piece::K]);
+    if (eng.opt_nmp && !pvnode && !check && ply > 0 && dep >= 2 && ev >= beta && pieces && !stack[ply-1].isbad()) {
+        // Reduce more at higher depths (adaptive null move pruning)
+        int r = dep > 6 ? 3 : 2;
+
+        undo u;
+        s.make_null(u);
+        nodes++;
+        stack[ply] = move();
+        int score = -search(s, -beta, -beta+1, dep-1-r, ply+1);
+        s.unmake_null(u);
+
+        if (stopped) return 0;
+
+        // Don't trust mate scores from a position that can't happen
+        if (score >= beta) return score_ismate(score) ? beta : score;
+    }
+
+    // Futility pruning: near the leaves, if we're so far below alpha that a quiet move is unlikely
+    //   to make up for it, only captures, promotions, and checks are searched
+    bool futile = eng.opt_fp && !pvnode && !check && dep <= FP_DEPTH && !score_ismate(alpha) && ev + FP_MARGIN * dep <= alpha;
+
+    move counter = ply > 0 && !stack[ply-1].isbad() ? countermoves[stack[ply-1].from()][stack[ply-1].to()] : move();
+    MovePicker mp(s, ttmove, killers[ply], false, counter, history[s.tomove]);
+
+    int best = -SCORE_INF;
+    move bm;
+    int nmoves = 0;
+
+    // Quiet moves searched so far, which didn't cause a cutoff
+    movelist quiets;
+    quiets.clear();
+
+    for (move mv = mp.next(); !mv.isbad(); mv = mp.next()) {
+        nmoves++;
+        bool quiet = !mv.iscapture() && !mv.ispromo();
+
+        undo u;
+        s.make(mv, u);
+        bool givescheck = s.in_check();
+
+        // The first move is always searched, so there is a score
+        if (futile && quiet && nmoves > 1 && !givescheck) {
+            s.unmake(mv, u);
+            continue;
+        }
+
+        nodes++;
+        stack[ply] = mv;
+
+        // Late move reductions: with good move ordering, quiet moves late in the list rarely turn
+        //   out best, so they are searched shallower first, and only searched fully if they beat alpha
+        int r = 0;
+        if (eng.opt_lmr && quiet && !check && !givescheck && dep >= LMR_DEPTH && nmoves > LMR_MOVES) {
+            r = min(i_lmr.r[min(dep, 63)][min(nmoves, 63)], dep - 2);
+        }
+
+        // Principal variation search: the first move is expected to be best, so the rest are only
+        //   searched with a null window to prove they're no better, and re-searched with the full
+        //   window if they are
+        int score;
+        if (nmoves == 1) {
+            score = -search(s, -beta, -alpha, dep-1, ply+1);
+        } else {
+            score = -search(s, -alpha-1, -alpha, dep-1-r, ply+1);
+            if (r > 0 && score > alpha && !stopped) score = -search(s, -alpha-1, -alpha, dep-1, ply+1);
+            if (score > alpha && score < beta && !stopped) score = -search(s, -beta, -alpha, dep-1, ply+1);
+        }
+        s.unmake(mv, u);
+
+        // Don't let a stopped search's scores get into the transposition table
+        if (stopped) return 0;
+
+        if (score > best) {
+            best = score;
+            if (score > alpha) {
+                alpha = score;
+                bm = mv;
+                update_pv(mv, ply);
+                // The opponent would never allow this position
+                if (alpha >= beta) {
+                    cutoffs++;
+                    if (nmoves == 1) cutoffs_first++;
+
+                    if (quiet) update_quiet(s, mv, quiets, dep, ply);
+                    break;
+                }
+            }
+        }
+
+        if (quiet) quiets.push_back(mv);
+    }
+
+    if (nmoves == 0) {
+        // Checkmate or stalemate
+        return check ? -SCORE_MATE + ply : 0;
+    }
+
+    // Only a move that raised alpha is known to be best, otherwise keep the old one
+    Bound bound = best >= beta ? BOUND_LOWER : best > alpha0 ? BOUND_EXACT : BOUND_UPPER;
+    eng.tt.store(s.key, bm, i_tostore(best, ply), dep, bound);
+
+    return best;
+}
+
+// Margin for delta pruning, which covers positional gains from a capture
+#define QS_DELTA 200
+
+int Searcher::qsearch(State& s, int alpha, int beta, int ply) {
+    pvlen[ply] = ply;
+
+    if ((nodes & (STOP_CHECK_NODES - 1)) == 0) checkstop();
+    if (stopped) return 0;
+
+    seldepth = max(seldepth, ply);
+
+    // Static evaluation (which also finds checkmates and stalemates)
+    if (ply >= MAX_PLY) return i_fromeval(eng.eval_static(s), s.tomove, ply);
+
+    // When in check, standing pat isn't an option, so every evasion is tried
+    bool check = s.in_check();
+
+    int best = -SCORE_INF, stand = 0;
+    if (!check) {
+        stand = i_fromeval(eng.eval_static(s), s.tomove, ply);
+        if (stand >= beta) return stand;
+        if (stand > alpha) alpha = stand;
+        best = stand;
+    }
+
+    MovePicker mp(s, move(), NULL, !check);
+
+    int nmoves = 0;
+    for (move mv = mp.next(); !mv.isbad(); mv = mp.next()) {
+        nmoves++;
+
+        // Delta pruning: skip captures that can't raise alpha even if the piece is won for free
+        if (!check && !mv.ispromo()) {
+            int victim = mv.flags() == MF_EP ? Piece::P : s.board[mv.to()];
+            if (stand + piece_value[victim] + QS_DELTA <= alpha) continue;
+        }
+
+        // Skip captures that lose material once the exchange is played out
+        if (!check && s.see(mv) < 0) continue;
+
+        undo u;
+        s.make(mv, u);
+        nodes++;
+        qnodes++;
+        int score = -qsearch(s, -beta, -alpha, ply+1);
+        s.unmake(mv, u);
+
+        if (stopped) return 0;
+
+        if (score > best) {
+            best = score;
+            if (score > alpha) {
+                alpha = score;
+                update_pv(mv, ply);
+                if (alpha >= beta) break;
+            }
+        }
+    }
+
+    // Checkmate
+    if (check && nmoves == 0) return -SCORE_MATE + ply;
+
+    return best;
+}
+
+int Searcher::searchroot(State& s, int alpha, int beta, int dep, move first) {
+    pvlen[0] = 0;
+
+    // Try the best move from the last iteration first, which gives the most cutoffs
+    MovePicker mp(s, first);
+
+    int best = -SCORE_INF;
+    int nmoves = 0;
+    for (move mv = mp.next(); !mv.isbad(); mv = mp.next()) {
+        nmoves++;
+
+        undo u;
+        s.make(mv, u);
+        nodes++;
+        stack[0] = mv;
+
+        // Principal variation search, the same as in 'search()'
+        int score;
+        if (nmoves == 1) {
+            score = -search(s, -beta, -alpha, dep-1, 1);
+        } else {
+            score = -search(s, -alpha-1, -alpha, dep-1, 1);
+            if (score > alpha && score < beta && !stopped) score = -search(s, -beta, -alpha, dep-1, 1);
+        }
+        s.unmake(mv, u);
+
+        if (stopped) break;
+
+        if (score > best) {
+            best = score;
+            if (score > alpha) {
+                alpha = score;
+                update_pv(mv, 0);
+                if (alpha >= beta) break;
+            }
+        }
+    }
+
+    return best;
+}
+
+// Which depths helper threads skip, indexed by '(id - 1) % 20'
+// Depth 'dep' is skipped if '((dep + i_skipphase[k]) / i_skipsize[k]) % 2 != 0'
+static const int i_skipsize[20] = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+static const int i_skipphase[20] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+pair<move, int> Searcher::iterdeep(State& s, int maxdep) {
+    movelist moves;
+    s.getmoves(moves);
+    if (moves.size() == 0) {
+        // No legal moves, so the game is over
+        return pair<move, int>(move(), s.in_check() ? -SCORE_MATE : 0);
+    }
+
+    // Best move and score from the last completed iteration
+    move bm;
+    int bs = 0;
+
+    // Number of iterations in a row that the best move has stayed the same
+    int stable = 0;
+
+    for (int dep = 1; dep <= min(maxdep, MAX_PLY); ++dep) {
+        if (id > 0) {
+            int k = (id - 1) % 20;
+            if (((dep + i_skipphase[k]) / i_skipsize[k]) % 2 != 0) continue;
+        }
+
+        seldepth = 0;
+
+        // Aspiration windows: the score usually doesn't change much between iterations, so search
+        //   with a narrow window around the last one (which cuts off more), and widen whichever
+        //   side fails until the score is inside
+        int delta = ASP_WINDOW;
+        int alpha = -SCORE_INF, beta = SCORE_INF;
+        if (dep >= ASP_DEPTH && !score_ismate(bs)) {
+            alpha = max(bs - delta, -SCORE_INF);
+            beta = min(bs + delta, SCORE_INF);
+        }
+
+        int score;
+        while (true) {
+            score = searchroot(s, alpha, beta, dep, bm);
+            if (stopped) break;
+
+            if (score <= alpha && alpha > -SCORE_INF) {
+                alpha = max(alpha - delta, -SCORE_INF);
+            } else if (score >= beta && beta < SCORE_INF) {
+                beta = min(beta + delta, SCORE_INF);
+            } else {
+                break;
+            }
+            delta *= 2;
+        }
+
+        // Only use completed iterations, unless there are none yet (since any move is better
+        //   than none)
+        if (stopped) {
+            if (bm.isbad()) {
+                bm = pvlen[0] > 0 ? pv[0][0] : moves[0];
+                bs = pvlen[0] > 0 ? score : 0;
+                rootpv.assign(1, bm);
+            }
+            break;
+        }
+
+        stable = pv[0][0] == bm ? stable + 1 : 0;
+        bm = pv[0][0];
+        bs = score;
+        rootpv.assign(pv[0], pv[0] + pvlen[0]);
+        eng.tt.store(s.key, bm, bs, dep, BOUND_EXACT);
+
+        if (id == 0) {
+            eng.setbest(bm, bs, dep);
+            {
+                lock_guard<mutex> g(eng.lock);
+                eng.best_pv = rootpv;
+            }
+            if (eng.verbose) eng.print(info(dep));
+
+            // Don't start another iteration if it won't have time to finish
+            if (eng.tm.soft_exceeded(stable)) break;
+        }
+
+        // No need to search deeper once a forced checkmate is found
+        if (score_ismate(bs)) break;
+    }
+
+    return pair<move, int>(bm, bs);
+}
+
+string Searcher::info(int dep) {
+    nodes_pub.store(nodes, memory_order_relaxed);
+
+    string res = "info depth " + to_string(dep) + " seldepth " + to_string(seldepth);
+
+    // Mate scores are given in moves (not plies), and negative if we are getting mated
+    int score = eng.best_score();
+    if (score_ismate(score)) {
+        int n = score > 0 ? (SCORE_MATE - score + 1) / 2 : -(SCORE_MATE + score) / 2;
+        res += " score mate " + to_string(n);
+    } else {
+        res += " score cp " + to_string(score);
+    }
+
+    size_t n = eng.nodes_now();
+    int ms = max(1, eng.tm.elapsed());
+    res += " nodes " + to_string(n) + " nps " + to_string(n * 1000 / ms) + " time " + to_string(ms);
+
+    res += " pv";
+    for (size_t i = 0; i < rootpv.size(); ++i) {
+        res += " " + rootpv[i].LAN();
+    }
+    return res;
+}
+
+}
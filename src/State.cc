@@ -15,6 +15,9 @@ State State::from_FEN(const string& fen) {
     for (int i = 0; i < N_PIECES; ++i) {
         r.piece[i] = 0;
     }
+    for (int i = 0; i < 64; ++i) {
+        r.board[i] = -1;
+    }
 
     // Position in the string
     int pos = 0;
@@ -84,6 +87,7 @@ State State::from_FEN(const string& fen) {
             r.color[c] |= m;
             // Make sure the correct bit is set for this piece
             r.piece[p] |= m;
+            r.board[TILE(i, j)] = p;
             
             // Advance position
             i++;
@@ -172,6 +176,9 @@ State State::from_FEN(const string& fen) {
     // Subtract one due to 0-based indexing
     r.fullmove = stoi(fen.substr(pos)) - 1;
 
+    // Hash the position
+    r.key = r.compute_key();
+
     return r;
 }
 
@@ -249,83 +256,344 @@ string State::to_FEN() const {
     return r;
 }
 
-// Internal method to determine whether `mv` is a valid move
-bool isvalid(const State& s, const move& mv, bool ignorepins) {
-    if (mv.isbad()) {
-        // Out of range moves are never good
-        return false;
+uint64_t State::compute_key() const {
+    uint64_t r = 0;
+
+    for (int i = 0; i < 64; ++i) {
+        if (board[i] >= 0) {
+            Color c = (color[Color::WHITE] & ONEHOT(i)) ? Color::WHITE : Color::BLACK;
+            r ^= zobrist_piece[c][board[i]][i];
+        }
     }
+    if (tomove == Color::BLACK) r ^= zobrist_tomove;
+    r ^= zobrist_castle[castling()];
+    if (ep >= 0) r ^= zobrist_ep[ep % 8];
 
-    bb mf = ONEHOT(mv.from), mt = ONEHOT(mv.to);
-    bool issame = (s.color[s.tomove] & mf) != 0 && (s.color[s.tomove] & mt) != 0;
-    if (issame) {
-        // Can't move where your piece is
-        return false;
+    return r;
+}
+
+template<Color Us>
+void State::make(const move& mv, undo& u) {
+    assert(tomove == Us);
+    int from = mv.from(), to = mv.to(), flags = mv.flags();
+
+    // Direction pawns move in, and the first and last ranks from our side
+    const Color Them = Us == Color::WHITE ? Color::BLACK : Color::WHITE;
+    const int Up = Us == Color::WHITE ? 8 : -8;
+    const int Rank1 = Us == Color::WHITE ? 0 : 7;
+    const int Rank8 = 7 - Rank1;
+
+    // Get masks
+    bb mf = ONEHOT(from), mt = ONEHOT(to);
+
+    // Save what can't be recovered
+    u.captured = -1;
+    u.c_WK = c_WK;
+    u.c_WQ = c_WQ;
+    u.c_BK = c_BK;
+    u.c_BQ = c_BQ;
+    u.ep = ep;
+    u.hmclock = hmclock;
+    u.key = key;
+
+    // Take out the parts of the key that are about to change (they are added back at the end)
+    key ^= zobrist_castle[castling()];
+    if (ep >= 0) key ^= zobrist_ep[ep % 8];
+
+    // Piece moving from
+    int p = board[from];
+    // Assert we found a piece from the place that is moving!
+    assert(p >= 0);
+
+    // Remove the captured piece
+    if (flags == MF_EP) {
+        // The captured pawn is behind the target square
+        int tc = to - Up;
+        color[Them] &= ~ONEHOT(tc);
+        piece[Piece::P] &= ~ONEHOT(tc);
+        board[tc] = -1;
+        key ^= zobrist_piece[Them][Piece::P][tc];
+    } else if (mv.iscapture()) {
+        u.captured = board[to];
+        assert(u.captured >= 0);
+        color[Them] &= ~mt;
+        piece[u.captured] &= ~mt;
+        key ^= zobrist_piece[Them][u.captured][to];
     }
 
-    // At this point, just return early
-    if (ignorepins) return true; 
+    // Move the piece, which may become a different piece if it is a promotion
+    int np = mv.ispromo() ? mv.promo() : p;
+    color[Us] ^= mf | mt;
+    piece[p] &= ~mf;
+    piece[np] |= mt;
+    board[from] = -1;
+    board[to] = np;
+    key ^= zobrist_piece[Us][p][from] ^ zobrist_piece[Us][np][to];
+
+    // Handle castling, by moving the rook to the other side of the king
+    if (flags == MF_KCASTLE || flags == MF_QCASTLE) {
+        int rf = flags == MF_KCASTLE ? TILE(7, Rank1) : TILE(0, Rank1);
+        int rt = flags == MF_KCASTLE ? TILE(5, Rank1) : TILE(3, Rank1);
+        color[Us] ^= ONEHOT(rf) | ONEHOT(rt);
+        piece[Piece::R] ^= ONEHOT(rf) | ONEHOT(rt);
+        board[rf] = -1;
+        board[rt] = Piece::R;
+        key ^= zobrist_piece[Us][Piece::R][rf] ^ zobrist_piece[Us][Piece::R][rt];
+    }
 
-    // Create a new state
-    State ns = s;
+    // Moving the king or a rook loses castling rights, as does a rook being captured
+    bool& ck = Us == Color::WHITE ? c_WK : c_BK;
+    bool& cq = Us == Color::WHITE ? c_WQ : c_BQ;
+    bool& tk = Us == Color::WHITE ? c_BK : c_WK;
+    bool& tq = Us == Color::WHITE ? c_BQ : c_WQ;
+    if (from == TILE(4, Rank1)) ck = cq = false;
+    if (from == TILE(7, Rank1)) ck = false;
+    if (from == TILE(0, Rank1)) cq = false;
+    if (to == TILE(7, Rank8)) tk = false;
+    if (to == TILE(0, Rank8)) tq = false;
+
+    // A pawn moving 2 tiles can be captured en-passant on the tile it skipped
+    ep = flags == MF_DOUBLE ? from + Up : -1;
+
+    // Captures and pawn moves reset the half move clock
+    if (p == Piece::P || mv.iscapture()) {
+        hmclock = 0;
+    } else {
+        hmclock++;
+    }
 
+    // Now, increment state variables
+    if (Us == Color::BLACK) fullmove++;
+    tomove = Them;
 
-    // Apply move
-    ns.apply(mv);
-    assert(ns.tomove != s.tomove);
+    // Add back the new castling rights and en-passant file, and switch sides
+    key ^= zobrist_castle[castling()];
+    if (ep >= 0) key ^= zobrist_ep[ep % 8];
+    key ^= zobrist_tomove;
 
-    // Get king position and see if it is attacked
+#ifdef CCE_DEBUG
+    // Make sure the incremental update was correct
+    assert(key == compute_key());
+#endif
+}
 
-    // Positions of various pieces
-    int ntiles;
-    int tiles[64];
+template<Color Us>
+void State::unmake(const move& mv, const undo& u) {
+    assert(tomove != Us);
+    int from = mv.from(), to = mv.to(), flags = mv.flags();
+
+    const Color Them = Us == Color::WHITE ? Color::BLACK : Color::WHITE;
+    const int Up = Us == Color::WHITE ? 8 : -8;
+    const int Rank1 = Us == Color::WHITE ? 0 : 7;
+
+    // Switch back to the color that made the move
+    if (Us == Color::BLACK) fullmove--;
+    tomove = Us;
+
+    // Get masks
+    bb mf = ONEHOT(from), mt = ONEHOT(to);
+
+    // Find the piece that moved (which is now on 'to')
+    int p = board[to];
+    assert(p >= 0);
+
+    // Move it back, and un-promote it
+    int op = mv.ispromo() ? Piece::P : p;
+    color[Us] ^= mf | mt;
+    piece[p] &= ~mt;
+    piece[op] |= mf;
+    board[from] = op;
+    board[to] = -1;
+
+    // Put the rook back in the corner
+    if (flags == MF_KCASTLE || flags == MF_QCASTLE) {
+        int rf = flags == MF_KCASTLE ? TILE(7, Rank1) : TILE(0, Rank1);
+        int rt = flags == MF_KCASTLE ? TILE(5, Rank1) : TILE(3, Rank1);
+        color[Us] ^= ONEHOT(rf) | ONEHOT(rt);
+        piece[Piece::R] ^= ONEHOT(rf) | ONEHOT(rt);
+        board[rf] = Piece::R;
+        board[rt] = -1;
+    }
 
-    /* Generate king */
-    ntiles = bbtiles(ns.piece[Piece::K] & ns.color[s.tomove], tiles);
-    assert(ntiles == 1); // Must have exactly 1 king!
+    // Restore the captured piece
+    if (flags == MF_EP) {
+        int tc = to - Up;
+        color[Them] |= ONEHOT(tc);
+        piece[Piece::P] |= ONEHOT(tc);
+        board[tc] = Piece::P;
+    } else if (u.captured >= 0) {
+        color[Them] |= mt;
+        piece[u.captured] |= mt;
+        board[to] = u.captured;
+    }
 
-    // Now, switch back
-    if (ns.is_attacked(tiles[0])) {
-        // King cannot be attacked!
-        return false;
+    // Restore the rest
+    c_WK = u.c_WK;
+    c_WQ = u.c_WQ;
+    c_BK = u.c_BK;
+    c_BQ = u.c_BQ;
+    ep = u.ep;
+    hmclock = u.hmclock;
+    key = u.key;
+
+#ifdef CCE_DEBUG
+    assert(key == compute_key());
+#endif
+}
+
+void State::make(const move& mv, undo& u) {
+    if (tomove == Color::WHITE) {
+        make<Color::WHITE>(mv, u);
+    } else {
+        make<Color::BLACK>(mv, u);
     }
+}
+
+void State::unmake(const move& mv, const undo& u) {
+    // The color that made the move is the one not about to move
+    if (tomove == Color::BLACK) {
+        unmake<Color::WHITE>(mv, u);
+    } else {
+        unmake<Color::BLACK>(mv, u);
+    }
+}
+
+void State::make_null(undo& u) {
+    u.ep = ep;
+    u.hmclock = hmclock;
+    u.key = key;
+
+    // The en-passant capture is only available for a single move
+    if (ep >= 0) key ^= zobrist_ep[ep % 8];
+    ep = -1;
 
+    hmclock++;
+    tomove = tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
+    key ^= zobrist_tomove;
 
-    // Now, determine if it was valid
-    return true;
+#ifdef CCE_DEBUG
+    assert(key == compute_key());
+#endif
 }
 
+void State::unmake_null(const undo& u) {
+    tomove = tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
+    ep = u.ep;
+    hmclock = u.hmclock;
+    key = u.key;
+}
 
-bool State::is_attacked(int tile) const {
+bb State::attackers(int tile, bb occ) const {
+    return (attacks_P[Color::BLACK][tile] & color[Color::WHITE] & piece[Piece::P])
+         | (attacks_P[Color::WHITE][tile] & color[Color::BLACK] & piece[Piece::P])
+         | (attacks_N[tile] & piece[Piece::N])
+         | (attacks_K[tile] & piece[Piece::K])
+         | (bishop_attacks(tile, occ) & (piece[Piece::B] | piece[Piece::Q]))
+         | (rook_attacks(tile, occ) & (piece[Piece::R] | piece[Piece::Q]));
+}
+
+// Order that pieces are tried in for exchanges, from least to most valuable
+static const Piece i_see_order[N_PIECES] = { Piece::P, Piece::N, Piece::B, Piece::R, Piece::Q, Piece::K };
 
-    // Super inefficient! But more correct... We can speed it up later
-    vector<move> moves;
-    getmoves(moves, true, true);
+int State::see(const move& mv) const {
+    int from = mv.from(), to = mv.to();
+    Color us = tomove, them = us == Color::WHITE ? Color::BLACK : Color::WHITE;
 
-    int i;
-    for (i = 0; i < moves.size(); ++i) {
-        if (moves[i].to == tile) return true;
+    // 'gain[d]' is the material won by the side making the 'd'th capture, if the exchange stopped
+    //   right after it
+    int gain[32];
+    int d = 0;
+
+    int victim = mv.flags() == MF_EP ? Piece::P : board[to];
+    gain[0] = victim >= 0 ? piece_value[victim] : 0;
+
+    // Value of the piece that now stands on 'to', which is the next one to be captured
+    int cur = piece_value[board[from]];
+    if (mv.ispromo()) {
+        gain[0] += piece_value[mv.promo()] - piece_value[Piece::P];
+        cur = piece_value[mv.promo()];
     }
 
+    bb occ = (color[Color::WHITE] | color[Color::BLACK]) ^ ONEHOT(from);
+    if (mv.flags() == MF_EP) occ ^= ONEHOT(us == Color::WHITE ? to - 8 : to + 8);
+
+    // Sliders, which may be uncovered behind other pieces
+    bb diag = piece[Piece::B] | piece[Piece::Q], orth = piece[Piece::R] | piece[Piece::Q];
+
+    bb atk = attackers(to, occ) & occ;
+    Color side = them;
+    while (d < 31) {
+        // Find the least valuable attacker for 'side'
+        bb mine = atk & color[side];
+        if (!mine) break;
+
+        int p = 0;
+        bb sq = 0;
+        for (int i = 0; i < N_PIECES; ++i) {
+            p = i_see_order[i];
+            sq = mine & piece[p];
+            if (sq) break;
+        }
+
+        // The king can't capture onto a tile that is still defended
+        if (p == Piece::K && (atk & color[side == Color::WHITE ? Color::BLACK : Color::WHITE])) break;
+
+        d++;
+        gain[d] = cur - gain[d-1];
+        cur = piece_value[p];
+
+        // Take the piece off, and add any sliders behind it
+        occ ^= sq & -sq;
+        if (p == Piece::P || p == Piece::B || p == Piece::Q) atk |= bishop_attacks(to, occ) & diag;
+        if (p == Piece::R || p == Piece::Q) atk |= rook_attacks(to, occ) & orth;
+        atk &= occ;
+
+        side = side == Color::WHITE ? Color::BLACK : Color::WHITE;
+    }
+
+    // Each side may also stop capturing, so work backwards taking the better option
+    while (d > 0) {
+        gain[d-1] = -max(-gain[d-1], gain[d]);
+        d--;
+    }
+
+    return gain[0];
+}
+
+template<Color By>
+bool State::is_attacked(int tile) const {
+    bb them = color[By];
+
+    // Look outwards from 'tile' as each piece type, and see if it hits that piece
+    // A pawn of 'By' attacks 'tile' if a pawn of the other color on 'tile' would attack it
+    if (attacks_P[By == Color::WHITE ? Color::BLACK : Color::WHITE][tile] & them & piece[Piece::P]) return true;
+    if (attacks_N[tile] & them & piece[Piece::N]) return true;
+    if (attacks_K[tile] & them & piece[Piece::K]) return true;
+
+    bb occ = color[Color::WHITE] | color[Color::BLACK];
+    if (bishop_attacks(tile, occ) & them & (piece[Piece::B] | piece[Piece::Q])) return true;
+    if (rook_attacks(tile, occ) & them & (piece[Piece::R] | piece[Piece::Q])) return true;
+
     return false;
 }
 
-bool State::is_done(int& status) const {
-    vector<move> moves;
-    getmoves(moves);
-    if (moves.size() == 0) {
+bool State::is_attacked(int tile, Color by) const {
+    return by == Color::WHITE ? is_attacked<Color::WHITE>(tile) : is_attacked<Color::BLACK>(tile);
+}
 
-        // Get king's position
-        int ntiles;
-        int tiles[64];
-        ntiles = bbtiles(piece[Piece::K] & color[tomove], tiles);
-        assert(ntiles == 1); // Must have exactly 1 king!
+bb State::checkers() const {
+    // Must have exactly 1 king!
+    assert(popcount(piece[Piece::K] & color[tomove]) == 1);
 
-        // Check state from opposite perspective
-        State ns = *this;
-        ns.tomove = tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
+    Color other = tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
+    return attackers(lsb(piece[Piece::K] & color[tomove]), color[Color::WHITE] | color[Color::BLACK]) & color[other];
+}
 
-        if (ns.is_attacked(tiles[0])) {
+bool State::is_done(int& status) const {
+    movelist moves;
+    getmoves(moves);
+    if (moves.size() == 0) {
+        if (in_check()) {
             // Checkmate, the king is attacked and there are no legal moves
             status = tomove == Color::WHITE ? -1 : +1;
             return true;
@@ -342,514 +610,279 @@ bool State::is_done(int& status) const {
     }
 }
 
-void State::getmoves(vector<move>& res, bool ignorepins, bool ignorecastling) const {
+// Internal method to generate legal moves in 's' into 'res'
+// 'Us' must be the color about to move, which makes directions and ranks known at compile time
+// 'G' tells which moves to generate (see 'Gen')
+template<Color Us, Gen G>
+static void i_getmoves(const State& s, movelist& res) {
+    assert(s.tomove == Us);
     res.clear();
 
-    // Positions of various pieces
-    int ntiles;
-    int tiles[64];
+    // Unpack the state
+    const bb* color = s.color;
+    const bb* piece = s.piece;
+    int ep = s.ep;
 
     // Get the color mask to modify pieces with
-    bb cmask = color[tomove], omask = color[tomove == Color::WHITE ? Color::BLACK : Color::WHITE];
+    const Color Them = Us == Color::WHITE ? Color::BLACK : Color::WHITE;
+    bb cmask = color[Us], omask = color[Them];
 
-    // Try and add '_mv', by checking if it is legal
-    #define TRYADD(...) do { \
-        move mv_ = __VA_ARGS__; \
-        if (isvalid(*this, mv_, ignorepins)) { \
-            res.push_back(mv_); \
-        } \
+    // All occupied tiles, which block sliding pieces
+    bb occ = cmask | omask;
+
+    /* Find checks and pins */
+    if (popcount(piece[Piece::K] & cmask) != 1) {
+        return;
+    }
+    int kingpos = lsb(piece[Piece::K] & cmask);
+
+    // Enemy pieces giving check to our king
+    bb checkers = s.attackers(kingpos, occ) & omask;
+
+    // Enemy sliders that would attack our king if none of our pieces were in the way
+    bb snipers = omask & (
+        (bishop_attacks(kingpos, omask) & (piece[Piece::B] | piece[Piece::Q]))
+      | (rook_attacks(kingpos, omask) & (piece[Piece::R] | piece[Piece::Q]))
+    );
+
+    // Our pieces which are the only thing between a sniper and our king, which can only
+    //   move along that line
+    bb pinned = 0;
+    for (int tile : bbtiles(snipers)) {
+        bb btw = tiles_between[kingpos][tile] & occ;
+        if (btw && !(btw & (btw - 1))) {
+            pinned |= btw & cmask;
+        }
+    }
+
+    // Add a normal move, which is a capture if an enemy piece is on '_to'
+    #define ADD(_from, _to) do { \
+        int to_ = _to; \
+        res.push_back(move(_from, to_, (omask & ONEHOT(to_)) ? MF_CAPTURE : MF_QUIET)); \
     } while (0)
 
-    int from, to;
-    int i, j;
-    bb m;
+    // Tiles a piece on '_from' may move to, without exposing our king
+    #define PINMASK(_from) ((pinned & ONEHOT(_from)) ? tiles_line[kingpos][_from] : ~0ULL)
+
+    // Tiles we may move to, based on which moves are being generated
+    const bb genmask = G == Gen::GEN_NOISY ? omask : G == Gen::GEN_QUIET ? ~omask : ~0ULL;
 
     /* Generate king moves */
-    ntiles = bbtiles(piece[Piece::K] & cmask, tiles);
-    if (ntiles != 1) {
+    // Remove the king from the occupancy, so it can't step backwards along the line of a slider
+    for (int to : bbtiles(attacks_K[kingpos] & ~cmask & genmask)) {
+        if (!(s.attackers(to, occ ^ ONEHOT(kingpos)) & omask)) {
+            ADD(kingpos, to);
+        }
+    }
+
+    // In double check, only the king can move
+    if (checkers & (checkers - 1)) {
         return;
     }
-    assert(ntiles == 1); // Must have exactly 1 king!
-
-    int kingpos = from = tiles[0];
-    UNTILE(i, j, from);
-    
-    if (i >= 1 && j >= 1) TRYADD({from, TILE(i-1, j-1)});
-    if (i >= 1) TRYADD({from, TILE(i-1, j)});
-    if (i >= 1 && j <= 6) TRYADD({from, TILE(i-1, j+1)});
-    
-    if (j >= 1) TRYADD({from, TILE(i, j-1)});
-    if (j <= 6) TRYADD({from, TILE(i, j+1)});
-    
-    if (i <= 6 && j >= 1) TRYADD({from, TILE(i+1, j-1)});
-    if (i <= 6) TRYADD({from, TILE(i+1, j)});
-    if (i <= 6 && j <= 6)TRYADD({from, TILE(i+1, j+1)});
 
-    /* Generate queen moves */
-    ntiles = bbtiles(piece[Piece::Q] & cmask, tiles);
-    for (int k = 0; k < ntiles; ++k) {
-        from = tiles[k];
-        UNTILE(i, j, from);
-
-        // Add [i+n, j+n]
-        for (int n = 1; i + n < 8 && j + n < 8; ++n) {
-            to = TILE(i+n, j+n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        // Add [i+n, j-n]
-        for (int n = 1; i + n < 8 && j - n >= 0; ++n) {
-            to = TILE(i+n, j-n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        // Add [i-n, j+n]
-        for (int n = 1; i - n >= 0 && j + n < 8; ++n) {
-            to = TILE(i-n, j+n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        // Add [i-n, j-n]
-        for (int n = 1; i - n >= 0 && j - n >= 0; ++n) {
-            to = TILE(i-n, j-n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
+    // If we are in check, the other pieces must either capture the checking piece, or block it
+    bb evasion = ~0ULL;
+    if (checkers) {
+        evasion = tiles_between[kingpos][lsb(checkers)] | checkers;
+    }
 
+    // Tiles the other pieces may move to
+    bb target = evasion & ~cmask & genmask;
 
-        // Add [*, j]
-        for (int ti = i-1; ti >= 0; --ti) {
-            to = TILE(ti, j);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        for (int ti = i+1; ti < 8; ++ti) {
-            to = TILE(ti, j);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
+    /* Generate queen moves */
+    for (int from : bbtiles(piece[Piece::Q] & cmask)) {
 
-        // Add [i, *]
-        for (int tj = j-1; tj >=0; --tj) {
-            to = TILE(i, tj);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        for (int tj = j+1; tj < 8; ++tj) {
-            to = TILE(i, tj);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
+        // Any attacked tile not occupied by our own pieces
+        for (int to : bbtiles(queen_attacks(from, occ) & target & PINMASK(from))) ADD(from, to);
     }
 
     /* Generate bishop moves */
-    ntiles = bbtiles(piece[Piece::B] & cmask, tiles);
-    for (int k = 0; k < ntiles; ++k) {
-        from = tiles[k];
-        UNTILE(i, j, from);
-
-        // Add [i+n, j+n]
-        for (int n = 1; i + n < 8 && j + n < 8; ++n) {
-            to = TILE(i+n, j+n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        // Add [i+n, j-n]
-        for (int n = 1; i + n < 8 && j - n >= 0; ++n) {
-            to = TILE(i+n, j-n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        // Add [i-n, j+n]
-        for (int n = 1; i - n >= 0 && j + n < 8; ++n) {
-            to = TILE(i-n, j+n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        // Add [i-n, j-n]
-        for (int n = 1; i - n >= 0 && j - n >= 0; ++n) {
-            to = TILE(i-n, j-n);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
+    for (int from : bbtiles(piece[Piece::B] & cmask)) {
+
+        for (int to : bbtiles(bishop_attacks(from, occ) & target & PINMASK(from))) ADD(from, to);
     }
 
     /* Generate knight moves */
-    ntiles = bbtiles(piece[Piece::N] & cmask, tiles);
-    for (int k = 0; k < ntiles; ++k) {
-        from = tiles[k];
-        UNTILE(i, j, from);
-
-
-        // Consider all tiles (+-1, +-2) and (+-2, +-1) away, if they are in range
-        if (i <= 6 && j <= 5) TRYADD({from, TILE(i+1, j+2)});
-        if (i >= 1 && j <= 5) TRYADD({from, TILE(i-1, j+2)});
-        if (i <= 6 && j >= 2) TRYADD({from, TILE(i+1, j-2)});
-        if (i >= 1 && j >= 2) TRYADD({from, TILE(i-1, j-2)});
-
-        if (i <= 5 && j <= 6) TRYADD({from, TILE(i+2, j+1)});
-        if (i >= 2 && j <= 6) TRYADD({from, TILE(i-2, j+1)});
-        if (i <= 5 && j >= 1) TRYADD({from, TILE(i+2, j-1)});
-        if (i >= 2 && j >= 1) {
-            TRYADD({from, TILE(i-2, j-1)});
-        }
+    // A pinned knight can never move, since it can't stay on the line
+    for (int from : bbtiles(piece[Piece::N] & cmask & ~pinned)) {
+        for (int to : bbtiles(attacks_N[from] & target)) ADD(from, to);
     }
 
     /* Generate rook moves */
-    ntiles = bbtiles(piece[Piece::R] & cmask, tiles);
-    for (int k = 0; k < ntiles; ++k) {
-        from = tiles[k];
-        UNTILE(i, j, from);
-
-        // Add [*, j]
-        for (int ti = i-1; ti >= 0; --ti) {
-            to = TILE(ti, j);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
-            }
-            TRYADD({from, to});
-        }
-        for (int ti = i+1; ti < 8; ++ti) {
-            to = TILE(ti, j);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
+    for (int from : bbtiles(piece[Piece::R] & cmask)) {
+
+        for (int to : bbtiles(rook_attacks(from, occ) & target & PINMASK(from))) ADD(from, to);
+    }
+
+    /* Generate pawn moves */
+    // All pawns are moved at once, by shifting the bitboard of pawns. 'up' is the direction
+    //   pawns move in, which is the offset from 'from' to 'to'
+    const int up = Us == Color::WHITE ? 8 : -8;
+    const bb rank3 = Us == Color::WHITE ? RANK_3 : RANK_6;
+    const bb rank8 = Us == Color::WHITE ? RANK_8 : RANK_1;
+    bb pawns = piece[Piece::P] & cmask;
+
+    // Single pushes onto empty tiles, and double pushes of the ones that landed on the third rank
+    bb push1 = shift(pawns, up) & ~occ;
+    bb push2 = shift(push1 & rank3, up) & ~occ & evasion;
+    push1 &= evasion;
+
+    // Captures towards the A file and the H file (pawns on that edge can't capture that way)
+    bb capA = shift(pawns & ~FILE_A, up - 1) & omask & evasion;
+    bb capH = shift(pawns & ~FILE_H, up + 1) & omask & evasion;
+
+    // Promotions count as noisy, even without a capture
+    if (G == Gen::GEN_NOISY) {
+        push1 &= rank8;
+        push2 = 0;
+    } else if (G == Gen::GEN_QUIET) {
+        push1 &= ~rank8;
+        capA = capH = 0;
+    }
+
+    // Add every pawn move landing in '_set', from '_off' tiles behind, with flags '_flags'
+    // Moves reaching the last rank are expanded into each promotion, and pinned pawns may
+    //   only move along the line of the pin
+    #define ADDPAWNS(_set, _off, _flags) do { \
+        for (int to_ : bbtiles(_set)) { \
+            int from_ = to_ - (_off); \
+            if ((pinned & ONEHOT(from_)) && !(tiles_line[kingpos][from_] & ONEHOT(to_))) continue; \
+            if (ONEHOT(to_) & rank8) { \
+                res.push_back(move(from_, to_, MF_PQ | (_flags))); \
+                res.push_back(move(from_, to_, MF_PN | (_flags))); \
+                res.push_back(move(from_, to_, MF_PR | (_flags))); \
+                res.push_back(move(from_, to_, MF_PB | (_flags))); \
+            } else { \
+                res.push_back(move(from_, to_, _flags)); \
+            } \
+        } \
+    } while (0)
+
+    ADDPAWNS(capA, up - 1, MF_CAPTURE);
+    ADDPAWNS(capH, up + 1, MF_CAPTURE);
+    ADDPAWNS(push1, up, MF_QUIET);
+    ADDPAWNS(push2, 2 * up, MF_DOUBLE);
+
+    #undef ADDPAWNS
+
+    // Handle en-passant captures, by the pawns that would attack the 'ep' tile
+    // This can uncover an attack on our king along the rank of both pawns, which
+    //   pins don't catch, so just check the resulting position
+    if (ep >= 0 && G != Gen::GEN_QUIET) {
+        bb cap = ONEHOT(ep - up);
+        for (int from : bbtiles(attacks_P[Them][ep] & pawns)) {
+            bb nocc = (occ ^ ONEHOT(from) ^ cap) | ONEHOT(ep);
+            if (!(s.attackers(kingpos, nocc) & omask & ~cap)) {
+                res.push_back(move(from, ep, MF_EP));
             }
-            TRYADD({from, to});
         }
+    }
 
-        // Add [i, *]
-        for (int tj = j-1; tj >=0; --tj) {
-            to = TILE(i, tj);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
+    #undef PINMASK
+    #undef ADD
+
+    /* Generate castling moves */
+    if (!checkers && G != Gen::GEN_NOISY) {
+        // Rank the king castles on
+        const int j = Us == Color::WHITE ? 0 : 7;
+        bool ck = Us == Color::WHITE ? s.c_WK : s.c_BK;
+        bool cq = Us == Color::WHITE ? s.c_WQ : s.c_BQ;
+
+        // The king may not castle through or into check, and the tiles between the
+        //   king and rook must be empty
+        if (ck && !(occ & (ONEHOT(TILE(5, j)) | ONEHOT(TILE(6, j))))) {
+            if (!s.is_attacked<Them>(TILE(5, j)) && !s.is_attacked<Them>(TILE(6, j))) {
+                res.push_back(move(TILE(4, j), TILE(6, j), MF_KCASTLE));
             }
-            TRYADD({from, to});
         }
-        for (int tj = j+1; tj < 8; ++tj) {
-            to = TILE(i, tj);
-            m = ONEHOT(to);
-            if (cmask & m) {
-                // Can't do our own pieces
-                break;
-            } else if (omask & m) {
-                // Can capture, but go no further
-                TRYADD({from, to});
-                break;
+        if (cq && !(occ & (ONEHOT(TILE(1, j)) | ONEHOT(TILE(2, j)) | ONEHOT(TILE(3, j))))) {
+            if (!s.is_attacked<Them>(TILE(3, j)) && !s.is_attacked<Them>(TILE(2, j))) {
+                res.push_back(move(TILE(4, j), TILE(2, j), MF_QCASTLE));
             }
-            TRYADD({from, to});
         }
     }
+}
 
 
-    /* Generate pawn moves */
-    ntiles = bbtiles(piece[Piece::P] & cmask, tiles);
-    for (int k = 0; k < ntiles; ++k) {
-        from = tiles[k];
-        UNTILE(i, j, from);
-
-        if (tomove == Color::WHITE) {
-            // White pawns move up
-
-            to = TILE(i, j+1);
-            m = ONEHOT(to);
-            if (!((cmask & m) || (omask & m))) {
-                TRYADD({from, to});
-
-                if (j == 1) {
-                    // Can move 2 tiles
-                    to = TILE(i, j+2);
-                    m = ONEHOT(to);
-                    if (!((cmask & m) || (omask & m))) {
-                        TRYADD({from, to});
-                    }
-                }
-            }
+void State::getmoves(movelist& res, Gen gen) const {
+    if (tomove == Color::WHITE) {
+        if (gen == Gen::GEN_ALL) i_getmoves<Color::WHITE, Gen::GEN_ALL>(*this, res);
+        else if (gen == Gen::GEN_NOISY) i_getmoves<Color::WHITE, Gen::GEN_NOISY>(*this, res);
+        else i_getmoves<Color::WHITE, Gen::GEN_QUIET>(*this, res);
+    } else {
+        if (gen == Gen::GEN_ALL) i_getmoves<Color::BLACK, Gen::GEN_ALL>(*this, res);
+        else if (gen == Gen::GEN_NOISY) i_getmoves<Color::BLACK, Gen::GEN_NOISY>(*this, res);
+        else i_getmoves<Color::BLACK, Gen::GEN_QUIET>(*this, res);
+    }
+}
 
-            // Handle diagonal captures
-            if (j <= 6) {
-                if (i <= 6) {
-                    to = TILE(i+1, j+1);
-                    m = ONEHOT(to);
-                    // Handle en-passant capture as well, with 'ep==to'
-                    if ((omask & m) || ep == to) {
-                        TRYADD({from, to});
-                    }
-                }
-                if (i >= 1) {
-                    to = TILE(i-1, j+1);
-                    m = ONEHOT(to);
-                    if ((omask & m) || ep == to) {
-                        TRYADD({from, to});
-                    }
-                }
-            }
+bool State::is_legal(const move& mv) const {
+    if (mv.isbad()) return false;
 
-        } else {
-            // Black pawns move down
-            to = TILE(i, j-1);
-            m = ONEHOT(to);
-            if (!((cmask & m) || (omask & m))) {
-                TRYADD({from, to});
-
-                if (j == 6) {
-                    // Can move 2 tiles
-                    to = TILE(i, j-2);
-                    m = ONEHOT(to);
-                    if (!((cmask & m) || (omask & m))) {
-                        TRYADD({from, to});
-                    }
-                }
-            }
+    int from = mv.from(), to = mv.to(), flags = mv.flags();
+    Color other = tomove == Color::WHITE ? Color::BLACK : Color::WHITE;
+    bb us = color[tomove], them = color[other], occ = us | them;
 
-            // Handle diagonal captures
-            if (j >= 1) {
-                if (i <= 6) {
-                    to = TILE(i+1, j-1);
-                    m = ONEHOT(to);
-                    if ((omask & m) || ep == to) {
-                        TRYADD({from, to});
-                    }
-                }
-                if (i >= 1) {
-                    to = TILE(i-1, j-1);
-                    m = ONEHOT(to);
-                    if ((omask & m) || ep == to) {
-                        TRYADD({from, to});
-                    }
-                }
-            }
-        }
-    }
+    // Must move one of our pieces, and not onto one of our pieces
+    if (!(us & ONEHOT(from)) || (us & ONEHOT(to))) return false;
 
-    /* Generate castling moves */
-    if (!ignorecastling) {
-            
-        if (tomove == Color::WHITE && (c_WK || c_WQ)) {
-
-            // White can castle either king or queen or both
-            // First, let's calculate moves that black has to see if they are attacking the squares we are going through
-            // We do this by duplicating the state but chaning the 'tomove' color
-            State ts = *this;
-            ts.tomove = Color::BLACK;
-            vector<move> bmv;
-            ts.getmoves(bmv, true, true);
-
-
-            if (c_WK) {
-                // Three tiles that must be passed through not in check
-                int t0 = TILE(4, 0), t1 = TILE(5, 0), t2 = TILE(6, 0);
-
-                if ((ONEHOT(t0) | ONEHOT(t1) | ONEHOT(t2)) & (omask | cmask)) {
-                    // Can't castle, people in the way
-                } else {
-                    bool good = true;
-                    for (int k = 0; k < bmv.size(); ++k) {
-                        int dest = bmv[k].to;
-                        if (dest == t0 || dest == t1 || dest == t2) {
-                            good = false;
-                            break;
-                        }
-                    }
-
-                    if (good) {
-                        // Just add, since we already checked whether we were attacked
-                        res.push_back({ TILE(4, 0), TILE(6, 0) });
-                    }
-
-                }
-            }
+    // Whether it captures must match what is on 'to'
+    if (flags != MF_EP && mv.iscapture() != ((them & ONEHOT(to)) != 0)) return false;
 
-            if (c_WQ) {
-                // Three tiles that must be passed through not in check
-                int t0 = TILE(4, 0), t1 = TILE(3, 0), t2 = TILE(2, 0);
-                if ((ONEHOT(t0) | ONEHOT(t1) | ONEHOT(t2)) & (omask | cmask)) {
-                    // Can't castle, people in the way
-                } else {
-                    bool good = true;
-                    for (int k = 0; k < bmv.size(); ++k) {
-                        int dest = bmv[k].to;
-                        if (dest == t0 || dest == t1 || dest == t2) {
-                            good = false;
-                            break;
-                        }
-                    }
-
-                    if (good) {
-                        // Just add, since we already checked whether we were attacked
-                        res.push_back({ TILE(4, 0), TILE(2, 0) });
-                    }
-                }
-            }
-        } else if (tomove == Color::BLACK && (c_BK || c_WQ)) {
-
-            // Black can castle either king or queen or both
-            // First, let's calculate moves that white has to see if they are attacking the squares we are going through
-            // We do this by duplicating the state but chaning the 'tomove' color
-            State ts = *this;
-            ts.tomove = Color::WHITE;
-            vector<move> bmv;
-            ts.getmoves(bmv, true, true);
-
-            if (c_BK) {
-                // Three tiles that must be passed through not in check
-                int t0 = TILE(4, 7), t1 = TILE(5, 7), t2 = TILE(6, 7);
-                if ((ONEHOT(t0) | ONEHOT(t1) | ONEHOT(t2)) & (omask | cmask)) {
-                    // Can't castle, people in the way
-                } else {
-                    bool good = true;
-                    for (int k = 0; k < bmv.size(); ++k) {
-                        int dest = bmv[k].to;
-                        if (dest == t0 || dest == t1 || dest == t2) {
-                            good = false;
-                            break;
-                        }
-                    }
-
-                    if (good) {
-                        // Just add, since we already checked whether we were attacked
-                        res.push_back({ TILE(4, 7), TILE(6, 7) });
-                    }
-                }
-            }
-            if (c_BQ) {
-                // Three tiles that must be passed through not in check
-                int t0 = TILE(4, 7), t1 = TILE(3, 7), t2 = TILE(2, 7);
-                if ((ONEHOT(t0) | ONEHOT(t1) | ONEHOT(t2)) & (omask | cmask)) {
-                    // Can't castle, people in the way
-                } else {
-                    bool good = true;
-                    for (int k = 0; k < bmv.size(); ++k) {
-                        int dest = bmv[k].to;
-                        if (dest == t0 || dest == t1 || dest == t2) {
-                            good = false;
-                            break;
-                        }
-                    }
-
-                    if (good) {
-                        // Just add, since we already checked whether we were attacked
-                        res.push_back({ TILE(4, 7), TILE(2, 7) });
-                    }
-                }
-            }
+    int p = board[from];
+    if (p == Piece::P) {
+        int up = tomove == Color::WHITE ? 8 : -8;
+
+        // Pawns must promote exactly when reaching the last rank
+        if (mv.ispromo() != (to / 8 == (tomove == Color::WHITE ? 7 : 0))) return false;
+
+        if (flags == MF_EP) {
+            if (to != ep || !(attacks_P[tomove][from] & ONEHOT(to))) return false;
+        } else if (flags == MF_CAPTURE || (mv.ispromo() && mv.iscapture())) {
+            if (!(attacks_P[tomove][from] & ONEHOT(to))) return false;
+        } else if (flags == MF_DOUBLE) {
+            if (to != from + 2 * up || from / 8 != (tomove == Color::WHITE ? 1 : 6)) return false;
+            if (occ & (ONEHOT(from + up) | ONEHOT(to))) return false;
+        } else if (flags == MF_QUIET || mv.ispromo()) {
+            if (to != from + up || (occ & ONEHOT(to))) return false;
+        } else {
+            return false;
+        }
+    } else {
+        if (flags == MF_KCASTLE || flags == MF_QCASTLE) {
+            // This is rare, so just check against the generated moves
+            movelist moves;
+            getmoves(moves, Gen::GEN_QUIET);
+            return find(moves.begin(), moves.end(), mv) != moves.end();
+        } else if (flags != MF_QUIET && flags != MF_CAPTURE) {
+            // Only pawns have other kinds of moves
+            return false;
         }
+
+        bb att = 0;
+        if (p == Piece::K) att = attacks_K[from];
+        else if (p == Piece::Q) att = queen_attacks(from, occ);
+        else if (p == Piece::B) att = bishop_attacks(from, occ);
+        else if (p == Piece::N) att = attacks_N[from];
+        else if (p == Piece::R) att = rook_attacks(from, occ);
+        if (!(att & ONEHOT(to))) return false;
     }
 
+    // Finally, make sure it doesn't leave our king attacked
+    State ns = *this;
+    undo u;
+    ns.make(mv, u);
+    return !ns.is_attacked(lsb(ns.piece[Piece::K] & ns.color[tomove]), other);
 }
 
 
+// Instantiate the color-specialized methods, so they may be used outside this file
+template void State::make<Color::WHITE>(const move& mv, undo& u);
+template void State::make<Color::BLACK>(const move& mv, undo& u);
+template void State::unmake<Color::WHITE>(const move& mv, const undo& u);
+template void State::unmake<Color::BLACK>(const move& mv, const undo& u);
+template bool State::is_attacked<Color::WHITE>(int tile) const;
+template bool State::is_attacked<Color::BLACK>(int tile) const;
+
+
 }
@@ -0,0 +1,47 @@
+/* TimeManager.cc - Implementation of 'cce::TimeManager'
+ *
+ * @author: Cade Brown <cade@cade.site>
+ */
+
+#include <cce.hh>
+
+namespace cce {
+
+// How much of the soft limit to use (in percent), indexed by how many iterations in a row the best
+//   move has stayed the same (capped at the last entry)
+// A best move that keeps changing means the position is hard, so it gets more time, and a stable
+//   one means there's nothing more to find
+static const int i_stability[5] = { 160, 120, 100, 80, 60 };
+
+void TimeManager::init(const limits& lim, Color us) {
+    start = chrono::steady_clock::now();
+    soft = hard = -1;
+
+    if (lim.infinite) return;
+
+    if (lim.movetime > 0) {
+        // Use all of it, regardless of how stable the best move is
+        hard = max(1, lim.movetime - TM_OVERHEAD);
+    } else if (lim.hastime[us]) {
+        // A clock that is already out (or nearly) still gets the minimum time
+        int left = max(1, lim.time[us] - TM_OVERHEAD);
+        int mtg = lim.movestogo > 0 ? min(lim.movestogo, TM_MOVESTOGO) : TM_MOVESTOGO;
+
+        // Split the clock evenly between the moves left, plus most of the increment
+        soft = left / mtg + lim.inc[us] * 3 / 4;
+
+        // A single move may take a few times that, but never most of the clock
+        hard = min(left * 4 / 5, soft * 4);
+        soft = max(1, min(soft, hard));
+        hard = max(1, hard);
+    }
+}
+
+bool TimeManager::soft_exceeded(int stable) const {
+    if (soft < 0) return false;
+
+    int target = soft * i_stability[min(stable, 4)] / 100;
+    return elapsed() >= target;
+}
+
+}
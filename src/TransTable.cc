@@ -0,0 +1,120 @@
+/* TransTable.cc - Implementation of 'cce::TransTable'
+ *
+ * SEE: https://www.chessprogramming.org/Shared_Hash_Table#Lockless
+ *
+ * @author: Cade Brown <cade@cade.site>
+ */
+
+#include <cce.hh>
+
+#include <new>
+
+namespace cce {
+
+// Depths are stored unsigned in 8 bits (the search only stores depths of at least 1)
+static_assert(MAX_PLY <= 255, "'MAX_PLY' must fit in the 8 bit depth of a 'ttentry'");
+
+// Pack the fields of an entry into its 'data'
+static uint64_t i_pack(move mv, int score, int depth, Bound bound, int age) {
+    return (uint64_t)mv.bits
+         | (uint64_t)(uint16_t)(int16_t)score << 16
+         | (uint64_t)(uint8_t)depth << 32
+         | (uint64_t)bound << 40
+         | (uint64_t)age << 42;
+}
+
+// Age of an entry's 'data'
+static int i_age(uint64_t data) {
+    return (data >> 42) & 63;
+}
+
+// Depth of an entry's 'data'
+static int i_depth(uint64_t data) {
+    return (uint8_t)(data >> 32);
+}
+
+TransTable::TransTable(size_t mb) {
+    clusters = NULL;
+    mask = 0;
+    mem = NULL;
+    age = 0;
+    resize(mb);
+}
+
+TransTable::~TransTable() {
+    delete[] mem;
+}
+
+void TransTable::resize(size_t mb) {
+    delete[] mem;
+
+    // Round down to a power of two, so the index is just a mask
+    size_t n = 1;
+    while (2 * n * sizeof(ttcluster) <= mb * 1024 * 1024) n *= 2;
+
+    // Over-allocate so the clusters can start on a cache line
+    mem = new char[n * sizeof(ttcluster) + 63];
+    clusters = (ttcluster*)(((uintptr_t)mem + 63) & ~(uintptr_t)63);
+    mask = n - 1;
+    for (size_t i = 0; i < n; ++i) {
+        new (&clusters[i]) ttcluster();
+    }
+
+    clear();
+}
+
+void TransTable::clear() {
+    for (size_t i = 0; i <= mask; ++i) {
+        for (int j = 0; j < TT_CLUSTER; ++j) {
+            clusters[i].entries[j].check.store(0, memory_order_relaxed);
+            clusters[i].entries[j].data.store(0, memory_order_relaxed);
+        }
+    }
+    age = 0;
+}
+
+bool TransTable::probe(uint64_t key, ttdata& res) const {
+    const ttcluster& c = clusters[key & mask];
+    for (int j = 0; j < TT_CLUSTER; ++j) {
+        uint64_t data = c.entries[j].data.load(memory_order_relaxed);
+        if (data != 0 && (c.entries[j].check.load(memory_order_relaxed) ^ data) == key) {
+            res.mv.bits = data & 0xFFFF;
+            res.score = (int16_t)(uint16_t)(data >> 16);
+            res.depth = i_depth(data);
+            res.bound = (Bound)((data >> 40) & 3);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TransTable::store(uint64_t key, move mv, int score, int depth, Bound bound) {
+    ttcluster& c = clusters[key & mask];
+
+    // Replace the entry for the same key if there is one, otherwise the one that is least
+    //   worth keeping (shallow ones from old searches)
+    ttentry* ent = NULL;
+    int worst = 0;
+    for (int j = 0; j < TT_CLUSTER; ++j) {
+        ttentry& e = c.entries[j];
+        uint64_t data = e.data.load(memory_order_relaxed);
+        if ((e.check.load(memory_order_relaxed) ^ data) == key) {
+            // Keep the old move if there is no new one
+            if (mv.isbad()) mv.bits = data & 0xFFFF;
+            ent = &e;
+            break;
+        }
+
+        int value = data == 0 ? -1000 : i_depth(data) - 8 * ((age - i_age(data)) & 63);
+        if (!ent || value < worst) {
+            ent = &e;
+            worst = value;
+        }
+    }
+
+    uint64_t data = i_pack(mv, score, depth, bound, age);
+    ent->check.store(key ^ data, memory_order_relaxed);
+    ent->data.store(data, memory_order_relaxed);
+}
+
+}
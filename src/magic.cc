@@ -0,0 +1,164 @@
+/* magic.cc - Attack tables for each piece
+ *
+ * Kings, knights, and pawns just have a table indexed by tile
+ *
+ * Each sliding piece's attacks are found by masking the occupancy to the relevant tiles,
+ *   multiplying by a magic number, and shifting down to get an index into a precomputed
+ *   table. So, a bishop or rook lookup is just a multiply, shift, and load
+ *
+ * SEE: https://www.chessprogramming.org/Magic_Bitboards
+ *
+ * @author: Cade Brown <cade@cade.site>
+ */
+
+#include <cce.hh>
+
+namespace cce {
+
+// Magic multipliers for each tile, generated by 'tools/genmagic.py'
+static const bb magic_B_mul[64] = {
+    0x0420020200440080ULL, 0x300881012a020000ULL, 0x80100949e0b8220cULL, 0x0004441080308022ULL,
+    0x1504242080000400ULL, 0x101288a008001800ULL, 0x0800440208410001ULL, 0x0003120b0420040aULL,
+    0x089004500c810410ULL, 0x048010300200a028ULL, 0x90009080808100a1ULL, 0x0080082090290001ULL,
+    0x00c0140521000000ULL, 0x000c021110082408ULL, 0x0012010c01202a20ULL, 0x0000010401040220ULL,
+    0x2040142102040120ULL, 0xe020010888210060ULL, 0x0008000408002009ULL, 0x0008013222034204ULL,
+    0x42c4000201210120ULL, 0x4202401808080440ULL, 0x2004082101011000ULL, 0x0000500104060900ULL,
+    0x0020100208104180ULL, 0x0004020820080141ULL, 0x2116010108080224ULL, 0x04400400044102a0ULL,
+    0x2011010021444004ULL, 0x2011004018080820ULL, 0x1800808082082420ULL, 0x060100200200940aULL,
+    0x0010501000092210ULL, 0x0400c42000040800ULL, 0x1002005000010104ULL, 0x8021020084080080ULL,
+    0x0040010040420802ULL, 0x4244048200028818ULL, 0x000404208894008cULL, 0x0081045b00008405ULL,
+    0x0012020240842088ULL, 0x8034421030000409ULL, 0x0000201410002200ULL, 0x0002044200800808ULL,
+    0x2800081010408405ULL, 0x06b0112101001808ULL, 0x1010418210800400ULL, 0xc010420608300040ULL,
+    0x60010c9050085400ULL, 0x5808840422020000ULL, 0x80000b0488041144ULL, 0x0100800920884002ULL,
+    0x802804d022022204ULL, 0x2840085010108080ULL, 0x0020880108008100ULL, 0x0102903200950402ULL,
+    0x0800209808011000ULL, 0x0040082401084800ULL, 0x030080018404a841ULL, 0x900028920a104403ULL,
+    0x000800a040504100ULL, 0x1001102004410209ULL, 0x0282302008210640ULL, 0x8020380492808200ULL,
+};
+
+static const bb magic_R_mul[64] = {
+    0x1180004000108060ULL, 0x0540022000100040ULL, 0x2080082000100080ULL, 0x4100100008042100ULL,
+    0x1200100802002004ULL, 0x0d00040001008208ULL, 0xc200080400820001ULL, 0x01000422c1001082ULL,
+    0x2000800040008024ULL, 0x000a804002200180ULL, 0x0002002600c31080ULL, 0x1010801000080082ULL,
+    0x0304800800800400ULL, 0x004e000804420010ULL, 0x0d01000100040200ULL, 0x0001000060820100ULL,
+    0x0000828000400021ULL, 0x0510024000442000ULL, 0x0305090020004010ULL, 0x6040210010010008ULL,
+    0x0000808004000800ULL, 0x0094008080040200ULL, 0x01840c0002281110ULL, 0x0080020020410884ULL,
+    0x0180004440002000ULL, 0x0800500040002000ULL, 0x0040110100200040ULL, 0x0800201200400a00ULL,
+    0x0310040080800800ULL, 0x0012010180800400ULL, 0x8005000100040200ULL, 0x10000042000400a1ULL,
+    0x0000400285800420ULL, 0x0800400101002088ULL, 0x8005081041002000ULL, 0x2080800804801000ULL,
+    0x2000800800800400ULL, 0x1612001004040020ULL, 0x0004080204008110ULL, 0xc300004082000401ULL,
+    0x2028324000858000ULL, 0x0000200040008080ULL, 0x0010002804002000ULL, 0x0100081001010021ULL,
+    0x0130080011010004ULL, 0x0080040002008080ULL, 0x0802020801040010ULL, 0x000012a043020004ULL,
+    0x6001085220820200ULL, 0x0210420100802a00ULL, 0x0460002010008080ULL, 0x4400491001002300ULL,
+    0x4204008008000480ULL, 0x0000800400020080ULL, 0x0080024830210400ULL, 0x008400490c008200ULL,
+    0x3042110428800041ULL, 0x0009042010804001ULL, 0x300d018840600011ULL, 0x0088040900100021ULL,
+    0x00d5000410080043ULL, 0x0181000804000201ULL, 0x010030081500820cULL, 0x2000004680240702ULL,
+};
+
+magic magic_B[64], magic_R[64];
+
+bb attacks_K[64], attacks_N[64];
+bb attacks_P[N_COLORS][64];
+
+bb tiles_between[64][64];
+bb tiles_line[64][64];
+
+// Attack tables, which 'magic::attacks' point into
+// NOTE: The sizes are the sum of '1 << bits' for the masks of every tile
+static bb i_attacks_B[5248];
+static bb i_attacks_R[102400];
+
+// Ray directions, as (file, rank) offsets
+static const int i_dirs_B[4][2] = { {+1, +1}, {+1, -1}, {-1, +1}, {-1, -1} };
+static const int i_dirs_R[4][2] = { {+1, 0}, {-1, 0}, {0, +1}, {0, -1} };
+
+// Slow attack generation, by walking each ray one tile at a time, stopping at (and including)
+//   any blocker in 'occ'
+// If 'edges==false', then the last tile of each ray is not included (which is what the
+//   relevant occupancy masks need, since a piece on the edge never blocks anything)
+static bb i_rays(int tile, const int dirs[4][2], bb occ, bool edges) {
+    int i0, j0;
+    UNTILE(i0, j0, tile);
+
+    bb r = 0;
+    for (int d = 0; d < 4; ++d) {
+        int di = dirs[d][0], dj = dirs[d][1];
+        for (int i = i0 + di, j = j0 + dj; 0 <= i && i < 8 && 0 <= j && j < 8; i += di, j += dj) {
+            if (!edges && !(0 <= i + di && i + di < 8 && 0 <= j + dj && j + dj < 8)) break;
+            bb m = ONEHOT(TILE(i, j));
+            r |= m;
+            if (occ & m) break;
+        }
+    }
+    return r;
+}
+
+// Returns a bitboard of the tiles at the (file, rank) offsets 'offs' from 'tile', which are on the board
+static bb i_leaps(int tile, const int offs[][2], int noffs) {
+    int i0, j0;
+    UNTILE(i0, j0, tile);
+
+    bb r = 0;
+    for (int k = 0; k < noffs; ++k) {
+        int i = i0 + offs[k][0], j = j0 + offs[k][1];
+        if (0 <= i && i < 8 && 0 <= j && j < 8) r |= ONEHOT(TILE(i, j));
+    }
+    return r;
+}
+
+// Fill in the magic entries in 'res', allocating tables out of 'table'
+static void i_init_magic(magic* res, const bb* muls, const int dirs[4][2], bb* table) {
+    for (int tile = 0; tile < 64; ++tile) {
+        magic& m = res[tile];
+        m.mask = i_rays(tile, dirs, 0, false);
+        m.mul = muls[tile];
+
+        int bits = popcount(m.mask);
+        m.shift = 64 - bits;
+
+        m.attacks = table;
+        table += 1ULL << bits;
+
+        // Enumerate every subset of the mask (carry-rippler trick) and fill in its slot
+        bb sub = 0;
+        do {
+            m.attacks[((sub & m.mask) * m.mul) >> m.shift] = i_rays(tile, dirs, sub, true);
+            sub = (sub - m.mask) & m.mask;
+        } while (sub);
+    }
+}
+
+void init_attacks() {
+    static const int offs_K[8][2] = { {-1, -1}, {-1, 0}, {-1, +1}, {0, -1}, {0, +1}, {+1, -1}, {+1, 0}, {+1, +1} };
+    static const int offs_N[8][2] = { {+1, +2}, {-1, +2}, {+1, -2}, {-1, -2}, {+2, +1}, {-2, +1}, {+2, -1}, {-2, -1} };
+    static const int offs_PW[2][2] = { {-1, +1}, {+1, +1} };
+    static const int offs_PB[2][2] = { {-1, -1}, {+1, -1} };
+
+    for (int tile = 0; tile < 64; ++tile) {
+        attacks_K[tile] = i_leaps(tile, offs_K, 8);
+        attacks_N[tile] = i_leaps(tile, offs_N, 8);
+        attacks_P[Color::WHITE][tile] = i_leaps(tile, offs_PW, 2);
+        attacks_P[Color::BLACK][tile] = i_leaps(tile, offs_PB, 2);
+    }
+
+    i_init_magic(magic_B, magic_B_mul, i_dirs_B, i_attacks_B);
+    i_init_magic(magic_R, magic_R_mul, i_dirs_R, i_attacks_R);
+
+    // Now that sliders work, use them to find lines between tiles
+    for (int a = 0; a < 64; ++a) {
+        for (int b = 0; b < 64; ++b) {
+            bb ab = ONEHOT(a) | ONEHOT(b);
+            tiles_between[a][b] = tiles_line[a][b] = 0;
+            if (a == b) continue;
+
+            if (bishop_attacks(a, 0) & ONEHOT(b)) {
+                tiles_between[a][b] = bishop_attacks(a, ONEHOT(b)) & bishop_attacks(b, ONEHOT(a));
+                tiles_line[a][b] = (bishop_attacks(a, 0) & bishop_attacks(b, 0)) | ab;
+            } else if (rook_attacks(a, 0) & ONEHOT(b)) {
+                tiles_between[a][b] = rook_attacks(a, ONEHOT(b)) & rook_attacks(b, ONEHOT(a));
+                tiles_line[a][b] = (rook_attacks(a, 0) & rook_attacks(b, 0)) | ab;
+            }
+        }
+    }
+}
+
+}
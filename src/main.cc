@@ -8,6 +8,26 @@
 using namespace cce;
 
 
+#ifdef CCE_ALLOCS
+
+// Number of heap allocations made, which is used to check that hot paths (move generation,
+//   search, perft) do not allocate per node
+// Enable with '-DCCE_ALLOCS'
+static atomic<size_t> n_allocs(0);
+
+void* operator new(size_t sz) {
+    n_allocs++;
+    void* res = malloc(sz);
+    if (!res) throw bad_alloc();
+    return res;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+#endif
+
 // Splits 'line' into arguments (on spaces), populating 'args'
 static void splitargs(const string& line, vector<string>& args) {
     args.clear();
@@ -23,6 +43,16 @@ static void splitargs(const string& line, vector<string>& args) {
 
 
 
+// Returns the legal move in 's' whose long algebraic notation is 'lan', or a bad move if there is none
+static cce::move findmove(const State& s, const string& lan) {
+    movelist moves;
+    s.getmoves(moves);
+    for (int i = 0; i < moves.size(); ++i) {
+        if (moves[i].LAN() == lan) return moves[i];
+    }
+    return cce::move();
+}
+
 // Accept UCI commands and feed them to 'eng'
 static void do_uci(Engine& eng) {
     string line;
@@ -32,6 +62,14 @@ static void do_uci(Engine& eng) {
     cout << "id name cce 0.1" << endl;
     cout << "id author Cade Brown" << endl;
 
+    // Options that can be given to 'setoption'
+    cout << "option name Hash type spin default " << TT_DEFAULT_MB << " min 1 max " << TT_MAX_MB << endl;
+    cout << "option name Threads type spin default 1 min 1 max " << MAX_THREADS << endl;
+    cout << "option name NullMove type check default true" << endl;
+    cout << "option name LMR type check default true" << endl;
+    cout << "option name ReverseFutility type check default true" << endl;
+    cout << "option name Futility type check default true" << endl;
+
     cout << "uciok" << endl;
 
     while (getline(cin, line)) {
@@ -49,31 +87,56 @@ static void do_uci(Engine& eng) {
             // Ignore, as we're always UCI
         } else if (args[0] == "quit") {
             // Quit the entire program
+            eng.stop();
             return;
         } else if (args[0] == "isready") {
-            // Just a check-up, always return 'readyok'
-            cout << "readyok" << endl;
+            // Just a check-up, always return 'readyok' (even while searching)
+            eng.print("readyok");
         } else if (args[0] == "setoption") {
-            // Ignore for now
-            // Sets an option in a dictionary
+            // Format: setoption name <name> [value <value>], where both may contain spaces
+            string name, value;
+            string* cur = NULL;
+            for (int i = 1; i < args.size(); ++i) {
+                if (args[i] == "name") {
+                    cur = &name;
+                } else if (args[i] == "value") {
+                    cur = &value;
+                } else if (cur) {
+                    if (cur->size() > 0) cur->push_back(' ');
+                    *cur += args[i];
+                }
+            }
+            if (!eng.setoption(name, value)) {
+                if (eng.hasoption(name)) {
+                    cerr << "Bad value for option '" << name << "': '" << value << "'" << endl;
+                } else {
+                    cerr << "Unknown option: '" << name << "'" << endl;
+                }
+            }
         } else if (args[0] == "register") {
             // Ignore for now
         } else if (args[0] == "ucinewgame") {
-            // Ignore for now
+            // Forget about the last game
+            eng.newgame();
         } else if (args[0] == "position") {
+            // Format: position (startpos | fen <fen>) [moves <move>...]
             if (args.size() < 2) {
                 cerr << "Command 'position' expected 2 arguments or more" << endl;
             } else {
+                // Index of the 'moves' argument, if there is one
+                int mi = 2;
+                while (mi < args.size() && args[mi] != "moves") mi++;
+
                 string fen = "";
                 if (args[1] == "startpos") {
                     // We need to start from initial position
                     fen = FEN_START;
                 } else if (args[1] == "fen") {
-                    if (args.size() < 3) {
+                    if (mi <= 2) {
                         cerr << "Command 'position fen' expected at least 3 arguments giving FEN string" << endl;
                     } else {
-                        // Initialize from a FEN string (from remaining arguments)
-                        for (int i = 2; i < args.size(); ++i) {
+                        // Initialize from a FEN string (from the arguments before 'moves')
+                        for (int i = 2; i < mi; ++i) {
                             if (i > 2) fen.push_back(' ');
                             fen += args[i];
                         }
@@ -85,32 +148,82 @@ static void do_uci(Engine& eng) {
                     // Was successful, now set the engine to analyze this position
                     State s = State::from_FEN(fen);
 
+                    // Play the moves, which are in long algebraic notation
+                    for (int i = mi + 1; i < args.size(); ++i) {
+                        cce::move mv = findmove(s, args[i]);
+                        if (mv.isbad()) {
+                            cerr << "Illegal move in 'position': '" << args[i] << "'" << endl;
+                            break;
+                        }
+                        s.apply(mv);
+                    }
+
                     // Set state for the engine
                     eng.setstate(s);
                 }
             }
 
         } else if (args[0] == "go") {
-            // Start computing
-            eng.go();
-            
-            eng.stop();
-            // Print out best move (we need to lock it to avoid undefined behaviour)
-            eng.lock.lock();
+            // Format: go [wtime <ms>] [btime <ms>] [winc <ms>] [binc <ms>] [movestogo <n>]
+            //   [movetime <ms>] [depth <n>] [nodes <n>] [infinite]
+            // With none of those, search until 'stop' (like 'infinite')
+            limits lim;
+            bool given = false;
+            for (int i = 1; i < args.size(); ++i) {
+                if (args[i] == "infinite") {
+                    lim.infinite = true;
+                    given = true;
+                    continue;
+                }
+
+                // Every other argument takes a number, which is checked before it is used
+                string val = i + 1 < args.size() ? args[i + 1] : "";
+                int ival = 0;
+                int64_t lval = 0;
+                bool ok;
+                if (args[i] == "wtime" || args[i] == "btime") {
+                    ok = parse_int(val, ival);
+                    if (ok) {
+                        Color c = args[i] == "wtime" ? Color::WHITE : Color::BLACK;
+                        lim.time[c] = ival;
+                        lim.hastime[c] = true;
+                    }
+                } else if (args[i] == "winc" || args[i] == "binc") {
+                    ok = parse_int(val, ival) && ival >= 0;
+                    if (ok) lim.inc[args[i] == "winc" ? Color::WHITE : Color::BLACK] = ival;
+                } else if (args[i] == "movestogo") {
+                    ok = parse_int(val, ival) && ival >= 0;
+                    if (ok) lim.movestogo = ival;
+                } else if (args[i] == "movetime") {
+                    ok = parse_int(val, ival) && ival >= 0;
+                    if (ok) lim.movetime = ival;
+                } else if (args[i] == "depth") {
+                    ok = parse_int(val, ival);
+                    if (ok) lim.depth = max(1, min(ival, MAX_PLY));
+                } else if (args[i] == "nodes") {
+                    ok = parse_int(val, lval) && lval >= 0;
+                    if (ok) lim.nodes = lval;
+                } else {
+                    cerr << "Unknown 'go' argument: '" << args[i] << "'" << endl;
+                    continue;
+                }
 
-            cout << "bestmove " << eng.best_move.LAN() << endl;
-            eng.lock.unlock();
+                if (!ok) {
+                    cerr << "Bad value for 'go' argument '" << args[i] << "': '" << val << "'" << endl;
+                } else {
+                    given = true;
+                }
+                i++;
+            }
+            if (!given) lim.infinite = true;
 
+            // Start computing in the background, which prints 'bestmove' once it is done
+            eng.go(lim);
 
         } else if (args[0] == "stop") {
-            // Stop computing
+            // Stop computing, which makes the search thread print 'bestmove' right away
             eng.stop();
 
-            // Print out best move (we need to lock it to avoid undefined behaviour)
-            eng.lock.lock();
-            //cout << "bestmove " << eng.best_move.LAN() << endl;
-            eng.lock.unlock();
-
         } else {
             cerr << "Unknown command: '" << args[0] << "'" << endl;
         }
@@ -121,48 +234,350 @@ static void do_uci(Engine& eng) {
 
 // Perf test
 
-static size_t perft(const State& s, int dep=0) {
+// Default size of the perft hash table, in megabytes
+#define PERFT_HASH_MB 64
+
+// Entry in the perft hash table, which stores a node count for a (key, depth) pair
+// 'data' holds the count in its upper 56 bits and the depth in its lower 8, and 'check' holds
+//   'key ^ data'. Threads read and write entries without locking, so an entry that was torn
+//   by two racing writes just fails the check and counts as a miss
+struct perft_entry {
+    atomic<uint64_t> check, data;
+};
+
+// Hash table of perft results, shared between all threads
+static perft_entry* perft_hash = NULL;
+static size_t perft_hash_mask = 0;
+
+// Allocate (and clear) the perft hash table, with a size of about 'mb' megabytes (0 to disable it)
+static void perft_hash_init(size_t mb) {
+    delete[] perft_hash;
+    perft_hash = NULL;
+    perft_hash_mask = 0;
+    if (mb == 0) return;
+
+    // Round down to a power of two, so the index is just a mask
+    size_t n = 1;
+    while (2 * n * sizeof(perft_entry) <= mb * 1024 * 1024) n *= 2;
+
+    perft_hash = new perft_entry[n];
+    perft_hash_mask = n - 1;
+    for (size_t i = 0; i < n; ++i) {
+        perft_hash[i].check.store(0, memory_order_relaxed);
+        perft_hash[i].data.store(0, memory_order_relaxed);
+    }
+}
+
+static size_t perft(State& s, int dep=0) {
     if (dep <= 0) {
         return 1;
     }
 
+    // Get all available moves
+    movelist moves;
+    s.getmoves(moves);
+
+    // Moves are fully legal, so the leaves don't need to be made
+    if (dep == 1) return moves.size();
+
+    perft_entry* ent = NULL;
+    if (perft_hash) {
+        ent = &perft_hash[s.key & perft_hash_mask];
+        uint64_t data = ent->data.load(memory_order_relaxed);
+        if ((data & 0xFF) == (uint64_t)dep && (ent->check.load(memory_order_relaxed) ^ data) == s.key) {
+            return data >> 8;
+        }
+    }
+
     size_t res = 0;
+    for (int i = 0; i < moves.size(); ++i) {
+        undo u;
+        s.make(moves[i], u);
+        res += perft(s, dep-1);
+        s.unmake(moves[i], u);
+    }
 
-    // Get all available moves
-    vector<cce::move> moves;
+    if (ent) {
+        // Always replace, since the most recent subtrees are the likeliest to transpose again
+        uint64_t data = ((uint64_t)res << 8) | dep;
+        ent->check.store(s.key ^ data, memory_order_relaxed);
+        ent->data.store(data, memory_order_relaxed);
+    }
+
+    return res;
+}
+
+// Number of plies from the root at which the tree is split up between threads
+#define PERFT_SPLIT 2
+
+// Collect every position 'dep' plies from 's' into 'res'
+static void perft_collect(State& s, int dep, vector<State>& res) {
+    if (dep <= 0) {
+        res.push_back(s);
+        return;
+    }
+
+    movelist moves;
     s.getmoves(moves);
 
     for (int i = 0; i < moves.size(); ++i) {
-        State ns = s;
-        ns.apply(moves[i]);
-        res += perft(ns, dep-1);
+        undo u;
+        s.make(moves[i], u);
+        perft_collect(s, dep-1, res);
+        s.unmake(moves[i], u);
+    }
+}
+
+// Perf test, using 'nthreads' threads
+// The tree is split into subtrees 'PERFT_SPLIT' plies down (instead of at the root, since a few
+//   root moves can have much bigger subtrees than the rest), and each thread takes the next
+//   subtree from a shared counter when it finishes one, so they all stay busy
+static size_t perft_threaded(const State& s, int dep, int nthreads) {
+    // Leave at least one ply for the threads, so the leaves are still counted in bulk
+    int split = max(0, min(PERFT_SPLIT, dep-1));
+
+    State rs = s;
+    vector<State> subtrees;
+    perft_collect(rs, split, subtrees);
+
+    // Index of the next subtree to take, and the total number of nodes
+    atomic<size_t> next(0), res(0);
+
+    vector<thread> threads;
+    for (int i = 0; i < nthreads; ++i) {
+        threads.push_back(thread([&]() {
+            size_t nodes = 0;
+            size_t j;
+            while ((j = next++) < subtrees.size()) {
+                nodes += perft(subtrees[j], dep - split);
+            }
+            res += nodes;
+        }));
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].join();
     }
 
     return res;
 }
 
+// Run the 'perft' command, with arguments: [divide] <depth> [threads] [fen]
+// With 'divide', the node count under each root move is printed as well, which is the quickest
+//   way to narrow down a move generation bug (by comparing against another engine)
+static int do_perft(vector<string> args) {
+    bool divide = args.size() >= 1 && args[0] == "divide";
+    if (divide) args.erase(args.begin());
+
+    if (args.size() < 1) {
+        cerr << "Command 'perft' expected at least 1 argument (depth)" << endl;
+        return 1;
+    }
+
+    int dep = stoi(args[0]);
+    int nthreads = args.size() >= 2 ? stoi(args[1]) : 1;
+    if (nthreads < 1) nthreads = 1;
+
+    string fen = FEN_START;
+    if (args.size() >= 3) {
+        // Rest of the arguments are the FEN
+        fen = "";
+        for (int i = 2; i < args.size(); ++i) {
+            if (i > 2) fen.push_back(' ');
+            fen += args[i];
+        }
+    }
+    State s = State::from_FEN(fen);
+
+    perft_hash_init(PERFT_HASH_MB);
+
+#ifdef CCE_ALLOCS
+    size_t allocs = n_allocs;
+#endif
+    chrono::steady_clock::time_point st = chrono::steady_clock::now();
+    size_t nodes = 0;
+    if (divide && dep >= 1) {
+        movelist moves;
+        s.getmoves(moves);
+        for (int i = 0; i < moves.size(); ++i) {
+            undo u;
+            s.make(moves[i], u);
+            size_t sub = perft_threaded(s, dep-1, nthreads);
+            s.unmake(moves[i], u);
+
+            cout << moves[i].LAN() << ": " << sub << endl;
+            nodes += sub;
+        }
+        cout << endl;
+    } else {
+        nodes = perft_threaded(s, dep, nthreads);
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - st).count();
+
+    cout << "nodes: " << nodes << endl;
+    cout << "time: " << secs << "s" << endl;
+    cout << "nps: " << (size_t)(nodes / max(secs, 1e-9)) << endl;
+#ifdef CCE_ALLOCS
+    cout << "allocs: " << n_allocs - allocs << endl;
+#endif
+
+    perft_hash_init(0);
+    return 0;
+}
+
+// Benchmark
+
+// Default search depth for 'bench'
+#define BENCH_DEPTH 5
+
+// Perft depth for 'bench'
+#define BENCH_PERFT_DEPTH 4
+
+// Positions used by 'bench', covering openings, middlegames and endgames, as well as castling,
+//   en passant, and promotions
+static const char* bench_fens[] = {
+    FEN_START,
+    "rnbqkbnr/pp1ppppp/8/2p5/4P3/8/PPPP1PPP/RNBQKBNR w KQkq c6 0 2",
+    "rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "8/P1k5/K7/8/8/8/8/8 w - - 0 1",
+    "8/8/8/8/8/8/6q1/R3K2k w Q - 0 1",
+};
+
+// Run the 'bench' command, with arguments: [depth] [threads]
+// Each position is searched to 'depth' and perft'd to 'BENCH_PERFT_DEPTH', and the total node
+//   count is printed as a signature of the engine's behaviour, along with the speed
+// NOTE: With more than one thread, the search node count is not deterministic
+static int do_bench(Engine& eng, const vector<string>& args) {
+    int dep = args.size() >= 1 ? stoi(args[0]) : BENCH_DEPTH;
+    int nthreads = args.size() >= 2 ? stoi(args[1]) : 1;
+    if (nthreads < 1) nthreads = 1;
+
+    perft_hash_init(PERFT_HASH_MB);
+
+    size_t n_search = 0, n_qsearch = 0, n_perft = 0;
+    size_t n_cutoffs = 0, n_cutoffs_first = 0;
+    double t_search = 0.0, t_perft = 0.0;
+
+    int npos = sizeof(bench_fens) / sizeof(*bench_fens);
+    for (int i = 0; i < npos; ++i) {
+        State s = State::from_FEN(bench_fens[i]);
+
+        chrono::steady_clock::time_point st = chrono::steady_clock::now();
+        eng.newgame();
+        eng.setstate(s);
+        eng.nthreads = nthreads;
+        limits lim;
+        lim.depth = dep;
+        cce::move bm = eng.findbest(s, lim).first;
+        size_t sn = eng.nodes, qn = eng.qnodes;
+        t_search += chrono::duration<double>(chrono::steady_clock::now() - st).count();
+
+        st = chrono::steady_clock::now();
+        size_t pn = perft_threaded(s, BENCH_PERFT_DEPTH, nthreads);
+        t_perft += chrono::duration<double>(chrono::steady_clock::now() - st).count();
+
+        cout << "position " << (i + 1) << "/" << npos << ": bestmove " << bm.LAN() << ", search " << sn << ", perft " << pn << endl;
+        n_search += sn;
+        n_qsearch += qn;
+        n_cutoffs += eng.cutoffs;
+        n_cutoffs_first += eng.cutoffs_first;
+        n_perft += pn;
+    }
+
+    perft_hash_init(0);
+
+    cout << endl;
+    cout << "search nodes: " << n_search << endl;
+    cout << "qsearch nodes: " << n_qsearch << endl;
+    cout << "first move cutoffs: " << 100.0 * n_cutoffs_first / max(n_cutoffs, (size_t)1) << "%" << endl;
+    cout << "search nps: " << (size_t)(n_search / max(t_search, 1e-9)) << endl;
+    cout << "perft nodes: " << n_perft << endl;
+    cout << "perft nps: " << (size_t)(n_perft / max(t_perft, 1e-9)) << endl;
+    cout << "nodes: " << n_search + n_perft << endl;
+    cout << "time: " << t_search + t_perft << "s" << endl;
+    cout << "nps: " << (size_t)((n_search + n_perft) / max(t_search + t_perft, 1e-9)) << endl;
+
+    return 0;
+}
+
+// Run the 'smp' command, with arguments: [depth] [maxthreads]
+// Searches every bench position to 'depth' with 1, 2, 4, ... up to 'maxthreads' threads, and prints
+//   the speed and time-to-depth of each, relative to 1 thread
+static int do_smp(Engine& eng, const vector<string>& args) {
+    int dep = args.size() >= 1 ? stoi(args[0]) : BENCH_DEPTH + 1;
+    int maxthreads = args.size() >= 2 ? stoi(args[1]) : 16;
+
+    int npos = sizeof(bench_fens) / sizeof(*bench_fens);
+
+    // Results for 1 thread
+    double t_1 = 0.0, nps_1 = 0.0;
+
+    cout << "threads nodes time nps nps-speedup ttd-speedup" << endl;
+    for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+        size_t nodes = 0;
+        double secs = 0.0;
+        for (int i = 0; i < npos; ++i) {
+            State s = State::from_FEN(bench_fens[i]);
+
+            eng.newgame();
+            eng.setstate(s);
+            eng.nthreads = nthreads;
+
+            chrono::steady_clock::time_point st = chrono::steady_clock::now();
+            limits lim;
+            lim.depth = dep;
+            eng.findbest(s, lim);
+            secs += chrono::duration<double>(chrono::steady_clock::now() - st).count();
+            nodes += eng.nodes;
+        }
+
+        double nps = nodes / max(secs, 1e-9);
+        if (nthreads == 1) {
+            t_1 = secs;
+            nps_1 = nps;
+        }
+
+        cout << nthreads << " " << nodes << " " << secs << "s " << (size_t)nps << " " << nps / nps_1 << "x " << t_1 / max(secs, 1e-9) << "x" << endl;
+    }
+
+    return 0;
+}
+
 int main(int argc, char** argv) {
 
     srand(time(NULL));
 
+    // Build attack tables
+    init();
+
     // Create engine
     Engine eng;
-    State s = State::from_FEN(FEN_START);
 
+    // Check for commands given as arguments
+    if (argc >= 2) {
+        string cmd = argv[1];
+        vector<string> args;
+        for (int i = 2; i < argc; ++i) {
+            args.push_back(argv[i]);
+        }
 
-    //cout << perft(s, 1) << endl;
-    //cout << perft(s, 2) << endl;
-    //cout << perft(s, 3) << endl;
-    cout << perft(s, 4) << endl;
-    //cout << perft(s, 5) << endl;
-    //cout << perft(s, 6) << endl;
-
-    /*
-    State s = State::from_FEN("r2k1bnr/pp3ppp/5q2/1NpP4/2nPQ3/2P5/PP3PPP/RNB1R1K1 w - - 0 13");
+        if (cmd == "perft") {
+            return do_perft(args);
+        } else if (cmd == "bench") {
+            return do_bench(eng, args);
+        } else if (cmd == "smp") {
+            return do_smp(eng, args);
+        } else {
+            cerr << "Unknown command: '" << cmd << "'" << endl;
+            return 1;
+        }
+    }
 
-    pair<cce::move, eval> bm = eng.findbest1(s);
-    cout << "BM: " << bm.first.LAN() << " EV: " << bm.second.getstr() << endl;
-    */
-    //do_uci(eng);
+    // Otherwise, speak UCI
+    do_uci(eng);
 
 }
@@ -5,6 +5,9 @@
 
 #include <cce.hh>
 
+#include <cerrno>
+#include <climits>
+
 namespace cce {
 
 // Internal array of square names
@@ -26,6 +29,11 @@ static string i_cp_names[][N_PIECES] = {
     {"k", "q", "b", "n", "r", "p"},
 };
 
+const int piece_value[N_PIECES] = {
+    // K, Q, B, N, R, P
+    0, 900, 315, 300, 500, 100,
+};
+
 const string& tile_name(int tile) {
     assert(0 <= tile && tile < 64);
     return i_tile_names[tile];
@@ -37,24 +45,76 @@ const string& cp_name(Color c, Piece p) {
     return i_cp_names[c][p];
 }
 
-int bbtiles(bb v, int pos[64]) {
-    if (!v) return 0;
+bool parse_int(const string& str, int64_t& res) {
+    if (str.size() == 0) return false;
+
+    char* end = NULL;
+    errno = 0;
+    long long val = strtoll(str.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0') return false;
+
+    res = val;
+    return true;
+}
+
+bool parse_int(const string& str, int& res) {
+    int64_t val;
+    if (!parse_int(str, val) || val < INT_MIN || val > INT_MAX) return false;
+
+    res = (int)val;
+    return true;
+}
+
+uint64_t zobrist_piece[N_COLORS][N_PIECES][64];
+uint64_t zobrist_tomove;
+uint64_t zobrist_castle[16];
+uint64_t zobrist_ep[8];
 
-    int r = 0;
-    // TODO: Use some primitives. For now, we can try this
-    bb m = 1, i = 0;
-    while (m) {
-        if (m & v) {
-            pos[r++] = i;
+// Internal random number generator (xorshift64*), which has a fixed seed so that keys
+//   are the same every run
+static uint64_t i_rand64() {
+    static uint64_t x = 0x2545F4914F6CDD1DULL;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+void init_zobrist() {
+    for (int c = 0; c < N_COLORS; ++c) {
+        for (int p = 0; p < N_PIECES; ++p) {
+            for (int i = 0; i < 64; ++i) {
+                zobrist_piece[c][p][i] = i_rand64();
+            }
         }
+    }
+    zobrist_tomove = i_rand64();
 
-        i++;
+    // Each castling right gets a key, and combinations are the XOR of each
+    uint64_t rights[4];
+    for (int i = 0; i < 4; ++i) {
+        rights[i] = i_rand64();
+    }
+    for (int i = 0; i < 16; ++i) {
+        zobrist_castle[i] = 0;
+        for (int j = 0; j < 4; ++j) {
+            if (i & (1 << j)) zobrist_castle[i] ^= rights[j];
+        }
+    }
 
-        // Move bit up one
-        m <<= 1;
+    for (int i = 0; i < 8; ++i) {
+        zobrist_ep[i] = i_rand64();
     }
+}
+
+void init() {
+    static bool done = false;
+    if (done) return;
+
+    init_attacks();
+    init_zobrist();
 
-    return r;
+    done = true;
 }
 
 
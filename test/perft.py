@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+""" test/perft.py - Tester to check move generation against known perft counts
+
+Runs `cce perft` on positions with known node counts, and exits with a non-zero status if any of them
+  don't match (so run it after any change to move generation)
+
+Examples:
+
+```
+$ test/perft.py
+$ test/perft.py --threads 4
+```
+
+SEE: https://www.chessprogramming.org/Perft_Results
+
+@author: Cade Brown <cade@cade.site>
+"""
+
+import sys
+import subprocess
+import argparse
+
+parser = argparse.ArgumentParser(description='Check move generation against known perft counts')
+
+parser.add_argument('--engine', default='./cce', help='Chess engine to use')
+parser.add_argument('--threads', default=1, type=int, help='Threads to run perft with')
+
+args = parser.parse_args()
+
+
+# (name, FEN, depth, nodes)
+positions = [
+    ('startpos',  'rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1', 5, 4865609),
+    ('kiwipete',  'r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1', 4, 4085603),
+    ('position3', '8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1', 5, 674624),
+    ('position4', 'r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1', 4, 422333),
+    ('position5', 'rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8', 4, 2103487),
+    ('position6', 'r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10', 4, 3894594),
+
+    # En passant that would expose the king along the rank (so it is illegal)
+    ('ep-pin',    '3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1', 6, 1134888),
+    # En passant that gives check
+    ('ep-check',  '8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1', 6, 1440467),
+    # Castling and promotion edge cases
+    ('castle',    'r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1', 4, 1274206),
+    ('promo',     '8/P1k5/K7/8/8/8/8/8 w - - 0 1', 6, 92683),
+]
+
+
+nfail = 0
+for name, fen, dep, expect in positions:
+    out = subprocess.run([args.engine, 'perft', str(dep), str(args.threads)] + fen.split(' '), stdout=subprocess.PIPE, encoding='utf-8').stdout
+
+    # Find the 'nodes: <n>' line
+    got = None
+    for line in out.split('\n'):
+        if line.startswith('nodes:'):
+            got = int(line.split(' ')[1])
+
+    ok = got == expect
+    if not ok:
+        nfail += 1
+    print('%-4s %-10s depth %d: %s (expected %d)' % ('ok' if ok else 'FAIL', name, dep, got, expect))
+
+print('%d/%d passed' % (len(positions) - nfail, len(positions)))
+sys.exit(1 if nfail > 0 else 0)
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+""" genmagic.py - Generates magic numbers for sliding piece attack tables
+
+Finds a multiplier for each tile such that '((occ & mask) * magic) >> (64 - bits)' maps
+  every relevant occupancy to a table slot without destructive collisions. The output
+  is pasted into 'src/magic.cc'
+
+SEE: https://www.chessprogramming.org/Magic_Bitboards
+
+@author: Cade Brown <cade@cade.site>
+"""
+
+import random
+
+M64 = (1 << 64) - 1
+
+# Deterministic, so the output is reproducible
+random.seed(0xCCE)
+
+def rays(tile, dirs, occ, edges):
+    """ Walk from 'tile' in each of 'dirs', stopping at (and including) blockers in 'occ'
+
+    If 'edges' is false, the last tile on each ray is not included (used for masks)
+    """
+    i0, j0 = tile % 8, tile // 8
+    r = 0
+    for di, dj in dirs:
+        i, j = i0 + di, j0 + dj
+        while 0 <= i < 8 and 0 <= j < 8:
+            if not edges and not (0 <= i + di < 8 and 0 <= j + dj < 8):
+                break
+            r |= 1 << (i + 8 * j)
+            if occ & (1 << (i + 8 * j)):
+                break
+            i, j = i + di, j + dj
+    return r
+
+DIRS_B = [(1, 1), (1, -1), (-1, 1), (-1, -1)]
+DIRS_R = [(1, 0), (-1, 0), (0, 1), (0, -1)]
+
+def find(tile, dirs):
+    mask = rays(tile, dirs, 0, False)
+    bits = bin(mask).count('1')
+
+    # Enumerate all subsets of the mask (carry-rippler trick)
+    occs, atts = [], []
+    sub = 0
+    while True:
+        occs.append(sub)
+        atts.append(rays(tile, dirs, sub, True))
+        sub = (sub - mask) & mask
+        if sub == 0:
+            break
+
+    while True:
+        # Sparse random numbers work much better
+        mul = random.getrandbits(64) & random.getrandbits(64) & random.getrandbits(64)
+        if bin(((mask * mul) & M64) >> 56).count('1') < 6:
+            continue
+        table = {}
+        good = True
+        for occ, att in zip(occs, atts):
+            idx = ((occ * mul) & M64) >> (64 - bits)
+            if table.setdefault(idx, att) != att:
+                good = False
+                break
+        if good:
+            return mul
+
+def output(name, dirs):
+    print('static const bb magic_%s_mul[64] = {' % (name,))
+    for row in range(16):
+        print('    ' + ', '.join('0x%016xULL' % find(4 * row + k, dirs) for k in range(4)) + ',')
+    print('};')
+
+output('B', DIRS_B)
+print()
+output('R', DIRS_R)